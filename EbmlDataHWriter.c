@@ -10,91 +10,71 @@
 #include <QuickTime/QuickTime.h>
 #include "EbmlDataHWriter.h"
 
-#include "EbmlWriter.h"
-//#include <cassert>
-//#include <limits>
-//#include <malloc.h>  //_alloca
-#include <stdlib.h>
-#include <wchar.h>
-#include <string.h>
+#include "log.h"
 
-#include "log.h";
-
-static void assignWide(wide *dest, wide *src)
-{
-    dest->hi = src->hi;
-    dest->lo = src->lo;
-}
-
-static void addToWide(wide *w, long val)
+static int _dataHWriteAt(void *refCon, unsigned long long pos, const void *buffer_in, unsigned long len)
 {
-    wide tmp;
-    tmp.hi = 0;
-    tmp.lo = val;
+    EbmlDataHSink *dataHSink = (EbmlDataHSink *)refCon;
+    SInt64 sPos = pos;
+    wide where = *(wide *)&sPos;
+    ComponentResult cResult = DataHWrite64(dataHSink->data_h, (void *)buffer_in, &where, len, NULL, 0);
 
-    WideAdd(w, &tmp);
-}
+    if (cResult != noErr)
+    {
+        dbg_printf("[WebM] DataHWrite64 of %lu bytes at %lld failed %ld\n", len, sPos, cResult);
+        return cResult;
+    }
 
+    if (sPos + (SInt64)len > dataHSink->size)
+        dataHSink->size = sPos + len;
 
-void Ebml_Write(EbmlGlobal *glob, const void *buffer_in, unsigned long len)
-{
-    ComponentResult cResult = DataHWrite64(glob->data_h, (void *)buffer_in, &glob->offset, len, NULL, 0);
-    addToWide(&glob->offset, len);
+    return noErr;
 }
 
-static void _Serialize(EbmlGlobal *glob, const unsigned char *p, const unsigned char *q)
+static int _dataHWrite(void *refCon, const void *buffer_in, unsigned long len)
 {
-    ComponentResult cResult;
-
-    while (q != p)
-    {
-        --q;
-
-        unsigned long cbWritten;
-        DataHWrite64(glob->data_h, (void *)q, &glob->offset, 1, NULL, 0);
-        addToWide(&glob->offset, 1);
-    }
+    EbmlDataHSink *dataHSink = (EbmlDataHSink *)refCon;
+    return _dataHWriteAt(refCon, dataHSink->size, buffer_in, len);
 }
 
-void Ebml_Serialize(EbmlGlobal *glob, const void *buffer_in, unsigned long len)
+static unsigned long long _dataHTell(void *refCon)
 {
-    //assert(buf);
-
-    const unsigned char *const p = (const unsigned char *)(buffer_in);
-    const unsigned char *const q = p + len;
-
-    _Serialize(glob, p, q);
+    EbmlDataHSink *dataHSink = (EbmlDataHSink *)refCon;
+    return dataHSink->size;
 }
 
-
-void Ebml_StartSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id)
+static int _dataHFlush(void *refCon)
 {
-    Ebml_WriteID(glob, class_id);
-    assignWide(&ebmlLoc->offset, &glob->offset);
-    //TODO this is always taking 8 bytes, this may need later optimization
-    unsigned long long unknownLen =  0x01FFFFFFFFFFFFFFLLU;
-    Ebml_Serialize(glob, (void *)&unknownLen, 8); //this is a key that says length unknown
+    EbmlDataHSink *dataHSink = (EbmlDataHSink *)refCon;
+    return DataHFlushData(dataHSink->data_h);
 }
 
-void Ebml_EndSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc)
+//lets a background writer thread call into the data handler
+static int _dataHAttachThread(void *refCon)
 {
-    wide currentEndOfFile;
-    assignWide(&currentEndOfFile, &glob->offset);
+    OSErr err = EnterMoviesOnThread(0);
 
-    UInt64 sizeOfElement = *(SInt64 *)&currentEndOfFile - *(SInt64 *)&ebmlLoc->offset -8;
+    if (err == noErr)
+        CSSetComponentsThreadMode(kCSAcceptAllComponentsMode);
 
-    assignWide(&glob->offset, &ebmlLoc->offset);
-    sizeOfElement |=  0x0100000000000000LLU;
-    Ebml_Serialize(glob, (void *)&sizeOfElement, 8);
-    assignWide(&glob->offset, &currentEndOfFile);
+    return err;
 }
 
-void Ebml_GetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc)
+static void _dataHDetachThread(void *refCon)
 {
-    assignWide(&ebmlLoc->offset, &glob->offset);
+    ExitMoviesOnThread();
 }
 
-void Ebml_SetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc)
+void Ebml_InitDataHSink(EbmlSink *sink, EbmlDataHSink *dataHSink, DataHandler data_h)
 {
-    assignWide(&glob->offset, &ebmlLoc->offset);
+    dataHSink->data_h = data_h;
+    dataHSink->size = 0;
+
+    sink->write = _dataHWrite;
+    sink->writeAt = _dataHWriteAt;
+    sink->tell = _dataHTell;
+    sink->flush = _dataHFlush;
+    sink->attachThread = _dataHAttachThread;
+    sink->detachThread = _dataHDetachThread;
+    sink->refCon = dataHSink;
 }
@@ -8,24 +8,19 @@
 
 
 
-#ifndef EBMLBUFFERWRITER_HPP
-#define EBMLBUFFERWRITER_HPP
+#ifndef EBMLDATAHWRITER_HPP
+#define EBMLDATAHWRITER_HPP
 
-typedef struct
-{
-    wide offset;
-} EbmlLoc;
+#include "EbmlSink.h"
 
+//sink writing through a QuickTime data handler opened for write
 typedef struct
 {
     DataHandler data_h;
-    wide offset;
-} EbmlGlobal;
+    SInt64 size;
+} EbmlDataHSink;
 
+void Ebml_InitDataHSink(EbmlSink *sink, EbmlDataHSink *dataHSink, DataHandler data_h);
 
-void Ebml_StartSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id);
-void Ebml_EndSubElement(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
-void Ebml_GetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
-void Ebml_SetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
 
 #endif
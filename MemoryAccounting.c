@@ -0,0 +1,144 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#include "MemoryAccounting.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "log.h"
+
+#define kVP8FrameBorder 32
+
+typedef struct
+{
+  SInt64 current;
+  SInt64 peak;
+} MemCounter;
+
+//updates come at most once per frame, a plain mutex keeps this portable to
+//the 32 bit targets where 64 bit atomics are not available
+static pthread_mutex_t memMutex = PTHREAD_MUTEX_INITIALIZER;
+static MemCounter memCounters[kMemSubsystemCount];
+static MemCounter memTotal;
+
+static const char *memNames[kMemSubsystemCount] =
+{
+  "frame queues",
+  "payload cache",
+  "cues",
+  "two pass stats",
+  "vp8 encoder",
+  "vp8 decoder",
+  "read buffers",
+  "import samples"
+};
+
+static void _memCount(MemCounter *counter, SInt64 bytes)
+{
+  counter->current += bytes;
+  if (counter->current > counter->peak)
+    counter->peak = counter->current;
+}
+
+void memAccountAdd(MemSubsystem subsystem, SInt64 bytes)
+{
+  if (bytes == 0 || subsystem < 0 || subsystem >= kMemSubsystemCount)
+    return;
+
+  pthread_mutex_lock(&memMutex);
+  _memCount(&memCounters[subsystem], bytes);
+  _memCount(&memTotal, bytes);
+  pthread_mutex_unlock(&memMutex);
+}
+
+void memAccountSet(MemSubsystem subsystem, SInt64 *accounted, SInt64 bytes)
+{
+  memAccountAdd(subsystem, bytes - *accounted);
+  *accounted = bytes;
+}
+
+static SInt64 _memRead(const SInt64 *value)
+{
+  SInt64 ret;
+
+  pthread_mutex_lock(&memMutex);
+  ret = *value;
+  pthread_mutex_unlock(&memMutex);
+  return ret;
+}
+
+SInt64 memAccountCurrent(MemSubsystem subsystem)
+{
+  if (subsystem < 0 || subsystem >= kMemSubsystemCount)
+    return 0;
+  return _memRead(&memCounters[subsystem].current);
+}
+
+SInt64 memAccountPeak(MemSubsystem subsystem)
+{
+  if (subsystem < 0 || subsystem >= kMemSubsystemCount)
+    return 0;
+  return _memRead(&memCounters[subsystem].peak);
+}
+
+SInt64 memAccountTotal(void)
+{
+  return _memRead(&memTotal.current);
+}
+
+SInt64 memAccountTotalPeak(void)
+{
+  return _memRead(&memTotal.peak);
+}
+
+const char *memAccountName(MemSubsystem subsystem)
+{
+  if (subsystem < 0 || subsystem >= kMemSubsystemCount)
+    return "unknown";
+  return memNames[subsystem];
+}
+
+void memAccountResetPeaks(void)
+{
+  int i;
+
+  pthread_mutex_lock(&memMutex);
+  for (i = 0; i < kMemSubsystemCount; i++)
+    memCounters[i].peak = memCounters[i].current;
+  memTotal.peak = memTotal.current;
+  pthread_mutex_unlock(&memMutex);
+}
+
+void memAccountDump(const char *job)
+{
+  MemCounter counters[kMemSubsystemCount];
+  MemCounter total;
+  int i;
+
+  //one consistent snapshot, the log is written without the lock
+  pthread_mutex_lock(&memMutex);
+  memcpy(counters, memCounters, sizeof(counters));
+  total = memTotal;
+  pthread_mutex_unlock(&memMutex);
+
+  dbg_printf("[%s] memory current / peak bytes\n", job);
+  for (i = 0; i < kMemSubsystemCount; i++)
+    dbg_printf("[%s]   %-16s %12lld %12lld\n", job, memNames[i],
+               counters[i].current, counters[i].peak);
+  dbg_printf("[%s]   %-16s %12lld %12lld\n", job, "total", total.current, total.peak);
+}
+
+SInt64 memAccountVP8FrameBytes(long width, long height)
+{
+  SInt64 alignedWidth = ((width + 15) & ~15) + 2 * kVP8FrameBorder;
+  SInt64 alignedHeight = ((height + 15) & ~15) + 2 * kVP8FrameBorder;
+
+  return alignedWidth * alignedHeight * 3 / 2;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef MEMORY_ACCOUNTING_H_
+#define MEMORY_ACCOUNTING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <QuickTime/QuickTime.h>
+
+
+//Process wide byte counts of the larger allocations, per subsystem.  The
+//exporter, importer and codecs all live in the one component bundle, so the
+//counters cover every instance that is open.  The codec contexts allocate
+//their frame buffers inside libvpx, those are estimates.
+typedef enum
+{
+  kMemFrameQueues = 0,  //queued frame data and ring slots
+  kMemPayloadCache,     //released payloads kept for reuse
+  kMemCues,
+  kMemTwoPassStats,
+  kMemVP8Encoder,       //source image and estimated encoder context
+  kMemVP8Decoder,       //estimated decoder context
+  kMemReadBuffers,      //MkvBufferedReaderQT read ahead buffers
+  kMemImportSamples,    //importer sample references waiting to be added
+  kMemSubsystemCount
+} MemSubsystem;
+
+//bytes is negative for a release
+void memAccountAdd(MemSubsystem subsystem, SInt64 bytes);
+//for owners that know their new total rather than the change, *accounted is
+//what the owner had counted so far and is updated to bytes
+void memAccountSet(MemSubsystem subsystem, SInt64 *accounted, SInt64 bytes);
+
+SInt64 memAccountCurrent(MemSubsystem subsystem);
+SInt64 memAccountPeak(MemSubsystem subsystem);
+//sum over all subsystems, and the highest that sum has been
+SInt64 memAccountTotal(void);
+SInt64 memAccountTotalPeak(void);
+const char *memAccountName(MemSubsystem subsystem);
+
+//peaks start again from the current counts, call when a job starts
+void memAccountResetPeaks(void);
+//writes current and peak of every subsystem to the debug log
+void memAccountDump(const char *job);
+
+//size of one VP8 frame buffer including the 32 pixel border libvpx adds
+SInt64 memAccountVP8FrameBytes(long width, long height);
+
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // MEMORY_ACCOUNTING_H_
@@ -22,6 +22,7 @@
 #include "vpx/vp8dx.h"
 #include "keystone_util.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 
 #include "VP8CodecVersion.h"
 #include "WebMExportVersions.h"
@@ -38,6 +39,7 @@ typedef struct
     vpx_codec_ctx_t             *ctx;
     vpx_image_t                 *lastImg;
     Handle                      wantedDestinationPixelTypes;
+    SInt64                      memAccounted;  //bytes counted as kMemVP8Decoder
   } VP8DecoderGlobalsRecord, *VP8DecoderGlobals;
 
 typedef struct
@@ -154,6 +156,7 @@ pascal ComponentResult VP8_Decoder_Close(VP8DecoderGlobals glob, ComponentInstan
 
       free(glob->ctx);
     }
+    memAccountSet(kMemVP8Decoder, &glob->memAccounted, 0);
 
     free(glob);
   }
@@ -293,6 +296,8 @@ pascal ComponentResult VP8_Decoder_Preflight(VP8DecoderGlobals glob, CodecDecomp
     dbg_printf("[vp8d - %08lx] vpx_QT_Dx: Failed to initialize decoder: %s\n", (UInt32) glob, vpx_codec_error(glob->ctx));
     return paramErr;
   }
+  //estimated, the last, golden and alt-ref references plus the frame being decoded
+  memAccountSet(kMemVP8Decoder, &glob->memAccounted, 4 * memAccountVP8FrameBytes(glob->width, glob->height));
 
 
 bail:
@@ -24,6 +24,7 @@
 #include "keystone_util.h"
 #include "log.h"
 #include "Raw_debug.h"
+#include "MemoryAccounting.h"
 
 #include "VP8CodecVersion.h"
 #include "VP8Encoder.h"
@@ -93,6 +94,7 @@ VP8_Encoder_Open(
   glob->stats.buf = NULL;
   //default to one pass
   glob->currentPass = VPX_RC_ONE_PASS;
+  glob->sourceQueue.head = 0;
   glob->sourceQueue.size = 0;
   glob->sourceQueue.max = 0;
   glob->sourceQueue.queue = NULL;
@@ -100,6 +102,7 @@ VP8_Encoder_Open(
   glob->sourceQueue.frames_out =0;
   glob->altRefFrame.buf =0;
   glob->altRefFrame.size =0;
+  glob->memAccounted = 0;
 
   int i;
   for (i=0;i<TOTAL_CUSTOM_VP8_SETTINGS; i++)
@@ -127,6 +130,7 @@ VP8_Encoder_Close(
     if (glob->stats.buf != NULL)
     {
       free(glob->stats.buf);
+      memAccountAdd(kMemTwoPassStats, -(SInt64) glob->stats.sz);
       glob->stats.buf =NULL;
       glob->stats.sz=0;
     }
@@ -147,6 +151,7 @@ VP8_Encoder_Close(
       vpx_img_free(glob->raw);
       free(glob->raw);
     }
+    memAccountSet(kMemVP8Encoder, &glob->memAccounted, 0);
 
     if (glob->sourceQueue.queue != NULL)
       free(glob->sourceQueue.queue);
@@ -439,6 +444,8 @@ VP8_Encoder_PrepareToCompressFrames(
     goto bail;
   }
 
+  accountEncoderMemory(glob);
+
   glob->maxEncodedDataSize = glob->width * glob->height * 2;
   dbg_printf("[vp8e - %08lx] currently allocating %d bytes as my max encoded size\n", (UInt32)glob, glob->maxEncodedDataSize);
 
@@ -720,6 +727,7 @@ pascal ComponentResult VP8_Encoder_BeginPass(VP8EncoderGlobals globals,ICMCompre
     if (globals->stats.buf != NULL)
     {
       free(globals->stats.buf);
+      memAccountAdd(kMemTwoPassStats, -(SInt64) globals->stats.sz);
       globals->stats.buf =NULL;
       globals->stats.sz=0;
     }
@@ -23,9 +23,18 @@ typedef struct
 
 typedef struct
 {
-  ICMCompressorSourceFrameRef* queue;
+  ICMCompressorSourceFrameRef frame;
+  UInt32 pts;          //time passed to vpx_codec_encode, packets carry it back
+  long displayNumber;  //increases through the queue
+}ICMCompressorSourceFrameEntry;
+
+//ring of frames handed to the codec and not yet emitted or dropped, in order
+typedef struct
+{
+  ICMCompressorSourceFrameEntry* queue;
+  int head;
   int size;
-  int max;
+  int max;  //power of two
   unsigned long frames_in;
   unsigned long frames_out;
 }ICMCompressorSourceFrameRefQueue;
@@ -54,6 +63,7 @@ typedef struct
   enum vpx_enc_pass         currentPass;
   ICMCompressorSourceFrameRefQueue sourceQueue;
   VP8Buffer altRefFrame;  ///an option dummy source frame
+  SInt64               memAccounted;  //bytes counted as kMemVP8Encoder
 
 } VP8EncoderGlobalsRecord, *VP8EncoderGlobals;
 
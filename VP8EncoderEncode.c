@@ -22,6 +22,7 @@
 
 #include "log.h"
 #include "Raw_debug.h"
+#include "MemoryAccounting.h"
 
 
 #include "VP8CodecVersion.h"
@@ -40,7 +41,8 @@ static void initializeCodec(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef
 static ComponentResult convertColorSpace(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame);
 
 //these are for the source frame queue
-static void addSourceFrame(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame);
+static ComponentResult addSourceFrame(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame, UInt32 pts);
+static ICMCompressorSourceFrameEntry *headSourceFrame(VP8EncoderGlobals glob);
 static ICMCompressorSourceFrameRef popSourceFrame(VP8EncoderGlobals glob);
 static Boolean isInQueue(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame);
 
@@ -116,7 +118,7 @@ static ComponentResult emitEncodedFrame(VP8EncoderGlobals glob, const vpx_codec_
   while (glob->sourceQueue.size > 0)
   {
     //time is in timeBase *2
-    UInt32 expectedTime = glob->sourceQueue.frames_out  * 2 ;
+    UInt32 expectedTime = headSourceFrame(glob)->pts;
     dbg_printf("Expected time = %lu\n", expectedTime);
     sourceFrame = popSourceFrame(glob);
     if (expectedTime >= pkt->data.frame.pts)
@@ -308,7 +310,10 @@ ComponentResult encodeThisSourceFrame(VP8EncoderGlobals glob,
   if (sourceFrame != NULL)
   {
     if (glob->currentPass != VPX_RC_FIRST_PASS)
-      addSourceFrame(glob,sourceFrame);
+    {
+      err = addSourceFrame(glob, sourceFrame, time2);
+      if (err) goto bail;
+    }
     err = convertColorSpace(glob, sourceFrame);
     if (err) goto bail;
     int flags = 0 ; //TODO - find out what I may need in these flags
@@ -368,6 +373,7 @@ ComponentResult encodeThisSourceFrame(VP8EncoderGlobals glob,
           dbg_printf("[vp8e - %08lx] Reallocation buffer size to %ld\n", (UInt32)glob, newSize);
           memcpy((char*)glob->stats.buf + glob->stats.sz, pkt->data.twopass_stats.buf,
                  pkt->data.twopass_stats.sz);
+          memAccountAdd(kMemTwoPassStats, pkt->data.twopass_stats.sz);
           glob->stats.sz = newSize;
         }
         break;
@@ -410,6 +416,7 @@ static void initializeCodec(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef
     dbg_printf("[vp8e - %08lx] Failed to initialize encoder pass = %d %s\n", (UInt32)glob, glob->currentPass, detail);
   }
   setCustomPostInit(glob);
+  accountEncoderMemory(glob);
 }
 
 
@@ -627,48 +634,87 @@ void setCustomPostInit(VP8EncoderGlobals glob)
     vpx_codec_control(glob->codec, VP8E_SET_ARNR_TYPE, glob->settings[28]);
 }
 
+//libvpx does not report its allocations, the context is estimated as the
+//lagged source frames plus the reference and scratch frames it keeps
+void accountEncoderMemory(VP8EncoderGlobals glob)
+{
+  SInt64 bytes = 0;
+
+  if (glob->raw != NULL && glob->raw->img_data != NULL)
+    bytes += (SInt64) glob->width * glob->height * 3 / 2;
+  if (glob->codec != NULL)
+    bytes += (glob->cfg.g_lag_in_frames + 5) * memAccountVP8FrameBytes(glob->width, glob->height);
+  memAccountSet(kMemVP8Encoder, &glob->memAccounted, bytes);
+}
+
 
-#define SFQ_INC_SIZE 10
+#define SFQ_INITIAL_SIZE 16
 //The source frame queue is maintained so we can match output packets to source frames in the queue
-static void addSourceFrame(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame)
+static ComponentResult addSourceFrame(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame, UInt32 pts)
 {
+  ICMCompressorSourceFrameRefQueue *q = &glob->sourceQueue;
 
-  if (glob->sourceQueue.size +1 > glob->sourceQueue.max)
+  if (q->size == q->max)
   {
-    glob->sourceQueue.max += SFQ_INC_SIZE;
-    glob->sourceQueue.queue = realloc(glob->sourceQueue.queue, glob->sourceQueue.max * sizeof(ICMCompressorSourceFrameRef));
+    //double the ring, the frames are unwrapped to start at slot 0
+    int max = q->max ? q->max * 2 : SFQ_INITIAL_SIZE;
+    ICMCompressorSourceFrameEntry *queue = malloc(max * sizeof(ICMCompressorSourceFrameEntry));
+    int i;
+
+    if (queue == NULL)
+      return mFulErr;
+    for (i = 0; i < q->size; i++)
+      queue[i] = q->queue[(q->head + i) & (q->max - 1)];
+    free(q->queue);
+    q->queue = queue;
+    q->max = max;
+    q->head = 0;
   }
-  glob->sourceQueue.queue[glob->sourceQueue.size] = sourceFrame;
-  glob->sourceQueue.size += 1;
-  glob->sourceQueue.frames_in += 1;
+
+  ICMCompressorSourceFrameEntry *entry = &q->queue[(q->head + q->size) & (q->max - 1)];
+  entry->frame = sourceFrame;
+  entry->pts = pts;
+  entry->displayNumber = ICMCompressorSourceFrameGetDisplayNumber(sourceFrame);
+  q->size += 1;
+  q->frames_in += 1;
+  return noErr;
+}
+
+static ICMCompressorSourceFrameEntry *headSourceFrame(VP8EncoderGlobals glob)
+{
+  if (glob->sourceQueue.size <= 0)
+    return NULL;
+  return &glob->sourceQueue.queue[glob->sourceQueue.head];
 }
 
 static ICMCompressorSourceFrameRef popSourceFrame(VP8EncoderGlobals glob)
 {
-  if (glob->sourceQueue.size <=0)
+  ICMCompressorSourceFrameRefQueue *q = &glob->sourceQueue;
+
+  if (q->size <=0)
   {
     dbg_printf("[VP8E] **ERROR in source frame queue! Popping a frame that doesn't exist!\n");
     return NULL;
   }
-  ICMCompressorSourceFrameRef rval = glob->sourceQueue.queue[0];
-  int i;
-  for (i=1;i < glob->sourceQueue.size; i ++)
-  {
-    glob->sourceQueue.queue[i-1] = glob->sourceQueue.queue[i];
-  }
-  glob->sourceQueue.size -=1;
-  glob->sourceQueue.frames_out += 1;
+  ICMCompressorSourceFrameRef rval = q->queue[q->head].frame;
+  q->head = (q->head + 1) & (q->max - 1);
+  q->size -=1;
+  q->frames_out += 1;
   return rval;
 }
 
+//Frames arrive in display order and leave from the head, so a frame is still
+//queued exactly when its display number lies between the oldest and newest.
 static Boolean isInQueue(VP8EncoderGlobals glob, ICMCompressorSourceFrameRef sourceFrame)
 {
-  int i;
-  for (i=0;i < glob->sourceQueue.size; i ++)
-  {
-    if (glob->sourceQueue.queue[i] == sourceFrame)
-      return true;
-  }
-  return false;
+  ICMCompressorSourceFrameRefQueue *q = &glob->sourceQueue;
+  long displayNumber;
+
+  if (q->size <= 0)
+    return false;
+
+  displayNumber = ICMCompressorSourceFrameGetDisplayNumber(sourceFrame);
+  return displayNumber >= q->queue[q->head].displayNumber &&
+         displayNumber <= q->queue[(q->head + q->size - 1) & (q->max - 1)].displayNumber;
 }
 
@@ -9,3 +9,4 @@
 ComponentResult encodeThisSourceFrame(VP8EncoderGlobals glob,
                                       ICMCompressorSourceFrameRef sourceFrame);
 void setCustomPostInit(VP8EncoderGlobals glob);
+void accountEncoderMemory(VP8EncoderGlobals glob);
@@ -211,7 +211,9 @@ _fillBuffer_callBack(ComponentInstance ci, UInt32 *ioNumberDataPackets, AudioBuf
 }
 
 
-static void _initAudioBufferList(GenericStreamPtr as, AudioBufferList **audioBufferList, UInt32 ioPackets)
+//the encoder writes straight into a pooled payload that is queued as it is
+static void _initAudioBufferList(GenericStreamPtr as, AudioBufferList **audioBufferList, UInt32 ioPackets,
+                                 WebMPayload **payload)
 {
   int i;
 
@@ -233,21 +235,22 @@ static void _initAudioBufferList(GenericStreamPtr as, AudioBufferList **audioBuf
   dbg_printf("[WebM]Calling InitAudioBufferList size %ld, each buffer being %lu\n", bufferListSize, maxBytesPerPacket);
 
   *audioBufferList = (AudioBufferList *) malloc(bufferListSize);
-  (*audioBufferList)->mNumberBuffers = ioPackets;
-  UInt32 wantedSize = maxBytesPerPacket * ioPackets;
-
-  if (as->aud.buf.data == NULL || as->aud.buf.size != wantedSize)
+  *payload = allocPayload(as->frameQueue.pool, maxBytesPerPacket * ioPackets);
+  if (*audioBufferList == NULL || *payload == NULL)
   {
-    as->aud.buf.data = realloc(as->aud.buf.data, wantedSize);
-    as->aud.buf.size = wantedSize;
-    as->aud.buf.offset = 0;
+    free(*audioBufferList);
+    *audioBufferList = NULL;
+    releasePayload(*payload);
+    *payload = NULL;
+    return;
   }
+  (*audioBufferList)->mNumberBuffers = ioPackets;
 
   for (i = 0; i < ioPackets; i++)
   {
     (*audioBufferList)->mBuffers[i].mNumberChannels = as->aud.asbd.mChannelsPerFrame;
     (*audioBufferList)->mBuffers[i].mDataByteSize = maxBytesPerPacket;
-    (*audioBufferList)->mBuffers[i].mData = (void *)((unsigned char *)as->aud.buf.data + maxBytesPerPacket * i);
+    (*audioBufferList)->mBuffers[i].mData = (void *)((*payload)->data + maxBytesPerPacket * i);
   }
 }
 
@@ -265,7 +268,13 @@ ComponentResult compressAudio(GenericStreamPtr as)
   packetDesc = (AudioStreamPacketDescription *)calloc(ioPackets, sizeof(AudioStreamPacketDescription));
 
   AudioBufferList *audioBufferList = NULL;
-  _initAudioBufferList(as, &audioBufferList, ioPackets);  //allocates memory
+  WebMPayload *payload = NULL;
+  _initAudioBufferList(as, &audioBufferList, ioPackets, &payload);  //allocates memory
+  if (audioBufferList == NULL || packetDesc == NULL)
+  {
+    err = mFulErr;
+    goto bail;
+  }
   dbg_printf("[WebM] call SCAudioFillBuffer(%x,%x,%x,%x,%x, %x)\n", as->aud.vorbisComponentInstance, _fillBuffer_callBack,
              (void *) as, &ioPackets,
              audioBufferList, packetDesc);
@@ -288,25 +297,28 @@ ComponentResult compressAudio(GenericStreamPtr as)
 
   if (ioPackets > 0)
   {
-    as->aud.buf.offset = 0;
+    UInt32 bytes = 0;
     int i = 0;
 
     for (i = 0; i < ioPackets; i++)
     {
       dbg_printf("[WebM] packet is %ld bytes, %ld frames\n", packetDesc[i].mDataByteSize,  packetDesc[i].mVariableFramesInPacket);
       as->framesOut += packetDesc[i].mVariableFramesInPacket;
-      as->aud.buf.offset += packetDesc[i].mDataByteSize;
+      bytes += packetDesc[i].mDataByteSize;
     }
-    //add a Frame Buffer to the queue
-    if (as->aud.buf.offset >0)
+    //the payload the packet was encoded into goes to the queue
+    if (bytes >0)
     {
-      UInt8* buf = malloc(as->aud.buf.offset);
       UInt32 timeMs = as->framesOut * 1000 / as->aud.asbd.mSampleRate;
-      memcpy(buf, as->aud.buf.data, as->aud.buf.offset);
       UInt16 frameType = KEY_FRAME + AUDIO_FRAME;
-      dbg_printf("[WebM] Output audio packet size %ld, time %lu\n", as->aud.buf.offset, timeMs);
-      addFrameToQueue(&as->frameQueue, buf,as->aud.buf.offset, timeMs, frameType, as->framesOut);
-      as->aud.buf.offset =0; //reset the buffer for writing
+      dbg_printf("[WebM] Output audio packet size %ld, time %lu\n", bytes, timeMs);
+      int queued = addFrameToQueue(&as->frameQueue, payload, 0, bytes, timeMs, frameType, as->framesOut);
+      payload = NULL;  //taken over by the queue, or released if it could not grow
+      if (queued != 0)
+      {
+        err = mFulErr;
+        goto bail;
+      }
     }
   }
 
@@ -317,6 +329,8 @@ ComponentResult compressAudio(GenericStreamPtr as)
 
 bail:
 
+  releasePayload(payload);
+
   if (audioBufferList != NULL)
     free(audioBufferList);
 
@@ -386,30 +400,11 @@ static void _dbg_printVorbisHeader(const UInt8 *ptr)
 
 }
 
-ComponentResult write_vorbisPrivateData(GenericStreamPtr as, UInt8 **buf, UInt32 *bufSize)
+//splits the three header packets out of the cookie and laces them into CodecPrivate
+static ComponentResult _vorbisPrivateDataFromCookie(void *magicCookie, UInt32 cookieSize,
+                                                    UInt8 **buf, UInt32 *bufSize)
 {
   ComponentResult err = noErr;
-  void *magicCookie = NULL;
-  UInt32 cookieSize = 0;
-  dbg_printf("[WebM] Get Vorbis Private Data\n");
-
-  err = QTGetComponentPropertyInfo(as->aud.vorbisComponentInstance,
-                                   kQTPropertyClass_SCAudio,
-                                   kQTSCAudioPropertyID_MagicCookie,
-                                   NULL, &cookieSize, NULL);
-
-  if (err) return err;
-
-  dbg_printf("[WebM] Cookie Size %d\n", cookieSize);
-
-  magicCookie = calloc(1, cookieSize);
-  err = QTGetComponentProperty(as->aud.vorbisComponentInstance,
-                               kQTPropertyClass_SCAudio,
-                               kQTSCAudioPropertyID_MagicCookie,
-                               cookieSize, magicCookie, NULL);
-
-  if (err) goto bail;
-
   UInt8 *ptrheader = (UInt8 *) magicCookie;
   UInt8 *cend = ptrheader + cookieSize;
   CookieAtomHeader *aheader = (CookieAtomHeader *) ptrheader;
@@ -476,6 +471,70 @@ ComponentResult write_vorbisPrivateData(GenericStreamPtr as, UInt8 **buf, UInt32
   ptr += header_vc.size;
   memcpy(ptr, header_cb.data, header_cb.size);
 
+bail:
+  return err;
+}
+
+//the cookie of a passthrough stream comes from the source sound description
+static ComponentResult _getSourceMagicCookie(GenericStreamPtr as, void **magicCookie, UInt32 *cookieSize)
+{
+  ComponentResult err = noErr;
+
+  initMovieGetParams(&as->source);
+  err = InvokeMovieExportGetDataUPP(as->source.refCon, &as->source.params, as->source.dataProc);
+
+  if (err) return err;
+
+  err = QTSoundDescriptionGetPropertyInfo((SoundDescriptionHandle) as->source.params.desc,
+                                          kQTPropertyClass_SoundDescription,
+                                          kQTSoundDescriptionPropertyID_MagicCookie,
+                                          NULL, cookieSize, NULL);
+
+  if (err) return err;
+
+  *magicCookie = calloc(1, *cookieSize);
+  if (*magicCookie == NULL) return mFulErr;
+
+  return QTSoundDescriptionGetProperty((SoundDescriptionHandle) as->source.params.desc,
+                                       kQTPropertyClass_SoundDescription,
+                                       kQTSoundDescriptionPropertyID_MagicCookie,
+                                       *cookieSize, *magicCookie, NULL);
+}
+
+ComponentResult write_vorbisPrivateData(GenericStreamPtr as, UInt8 **buf, UInt32 *bufSize)
+{
+  ComponentResult err = noErr;
+  void *magicCookie = NULL;
+  UInt32 cookieSize = 0;
+  dbg_printf("[WebM] Get Vorbis Private Data\n");
+
+  if (as->passthrough)
+  {
+    err = _getSourceMagicCookie(as, &magicCookie, &cookieSize);
+    if (err) goto bail;
+  }
+  else
+  {
+    err = QTGetComponentPropertyInfo(as->aud.vorbisComponentInstance,
+                                     kQTPropertyClass_SCAudio,
+                                     kQTSCAudioPropertyID_MagicCookie,
+                                     NULL, &cookieSize, NULL);
+
+    if (err) return err;
+
+    dbg_printf("[WebM] Cookie Size %d\n", cookieSize);
+
+    magicCookie = calloc(1, cookieSize);
+    err = QTGetComponentProperty(as->aud.vorbisComponentInstance,
+                                 kQTPropertyClass_SCAudio,
+                                 kQTSCAudioPropertyID_MagicCookie,
+                                 cookieSize, magicCookie, NULL);
+
+    if (err) goto bail;
+  }
+
+  err = _vorbisPrivateDataFromCookie(magicCookie, cookieSize, buf, bufSize);
+
 bail:
 
   if (magicCookie != NULL)
@@ -487,6 +546,79 @@ bail:
   return err;
 }
 
+//Fetches the first packet to look at the sound description, a Vorbis source
+//also fills in asbd for the track header.
+Boolean canPassthroughAudio(GenericStreamPtr as)
+{
+  ComponentResult err;
+  SoundDescriptionHandle sdh = NULL;
+  Boolean vorbis = false;
+
+  initMovieGetParams(&as->source);
+  err = InvokeMovieExportGetDataUPP(as->source.refCon, &as->source.params, as->source.dataProc);
+
+  if (err || as->source.params.desc == NULL)
+    return false;
+
+  err = QTSoundDescriptionConvert(kQTSoundDescriptionKind_Movie_AnyVersion,
+                                  (SoundDescriptionHandle) as->source.params.desc,
+                                  kQTSoundDescriptionKind_Movie_Version2,
+                                  &sdh);
+  if (err)
+    return false;
+
+  SoundDescriptionV2Ptr sd = (SoundDescriptionV2Ptr) * sdh;
+  _printSoundDesc(sd);
+
+  if (sd->dataFormat == kAudioFormatXiphVorbis)
+  {
+    vorbis = true;
+    as->aud.asbd.mFormatID = sd->dataFormat;
+    as->aud.asbd.mSampleRate = sd->audioSampleRate;
+    as->aud.asbd.mChannelsPerFrame = sd->numAudioChannels;
+  }
+
+  DisposeHandle((Handle) sdh);
+  return vorbis;
+}
+
+//passthrough counterpart of compressAudio, one source packet per block
+ComponentResult copyAudioPacket(GenericStreamPtr as)
+{
+  ComponentResult err = noErr;
+  MovieExportGetDataParams *params = &as->source.params;
+
+  if (as->source.eos)
+    return noErr;
+
+  initMovieGetParams(&as->source);
+  err = InvokeMovieExportGetDataUPP(as->source.refCon, params, as->source.dataProc);
+
+  if (err == eofErr || (err == noErr && params->actualSampleCount == 0))
+  {
+    as->source.eos = true;
+    as->complete = true;
+    return noErr;
+  }
+
+  if (err) return err;
+
+  dbg_printDataParams(&as->source);
+
+  WebMPayload *payload = allocPayload(as->frameQueue.pool, params->dataSize);
+  if (payload == NULL) return mFulErr;
+  memcpy(payload->data, params->dataPtr, params->dataSize);
+
+  UInt64 timeMs = (SInt64) params->actualTime * 1000 / as->source.timeScale;
+  as->framesIn += params->actualSampleCount;
+  as->framesOut = as->framesIn;
+  if (addFrameToQueue(&as->frameQueue, payload, 0, params->dataSize, timeMs, KEY_FRAME + AUDIO_FRAME, as->framesOut) != 0)
+    return mFulErr;
+
+  as->source.time = params->actualTime + params->durationPerSample * params->actualSampleCount;
+  return noErr;
+}
+
 ComponentResult initAudioStream(GenericStreamPtr as)
 {
   as->aud.vorbisComponentInstance = NULL;
@@ -494,9 +626,6 @@ ComponentResult initAudioStream(GenericStreamPtr as)
   as->framesOut = 0;
   as->framesIn =0;
   as->complete = false;
-  as->aud.buf.size =0;
-  as->aud.buf.offset=0;
-  as->aud.buf.data = NULL;
 
   return noErr;
 }
@@ -16,5 +16,8 @@ ComponentResult compressAudio(GenericStreamPtr as);
 ComponentResult write_vorbisPrivateData(GenericStreamPtr as, UInt8 **buf, UInt32 *bufSize);
 ComponentResult getInputBasicDescription(GenericStreamPtr as, AudioStreamBasicDescription *inFormat);
 ComponentResult initAudioStream(GenericStreamPtr as);
+//Vorbis sources are muxed without decoding and encoding again
+Boolean canPassthroughAudio(GenericStreamPtr as);
+ComponentResult copyAudioPacket(GenericStreamPtr as);
 
 #endif
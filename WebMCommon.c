@@ -8,17 +8,200 @@
 
 
 #include "WebMCommon.h"
+#include "MemoryAccounting.h"
 
-void initFrameQueue(WebMQueuedFrames *queue)
+#define kInitialFrameSlots 16
+#define kCueRowBytes (2 * sizeof(UInt64) + 2 * sizeof(UInt32))
+
+int initPayloadPool(WebMPayloadPool *pool, UInt64 maxCachedBytes)
+{
+  memset(pool, 0, sizeof(WebMPayloadPool));
+  pool->maxCachedBytes = maxCachedBytes;
+  return pthread_mutex_init(&pool->mutex, NULL) == 0 ? 0 : -1;
+}
+
+void freePayloadPool(WebMPayloadPool *pool)
+{
+  int i;
+
+  for (i = 0; i < kPayloadSizeClasses; i++)
+  {
+    while (pool->freeList[i] != NULL)
+    {
+      WebMPayload *payload = pool->freeList[i];
+      pool->freeList[i] = payload->next;
+      free(payload);
+    }
+  }
+  memAccountAdd(kMemPayloadCache, -(SInt64) pool->cachedBytes);
+  while (pool->freeBorrowed != NULL)
+  {
+    WebMPayload *payload = pool->freeBorrowed;
+    pool->freeBorrowed = payload->next;
+    free(payload);
+  }
+  pool->cachedBytes = 0;
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+static SInt32 _payloadSizeClass(UInt32 size)
+{
+  SInt32 sizeClass = 0;
+
+  if (size > kPayloadMaxPooled)
+    return kPayloadUnpooled;
+  while ((UInt32) kPayloadMinPooled << sizeClass < size)
+    sizeClass++;
+  return sizeClass;
+}
+
+WebMPayload *allocPayload(WebMPayloadPool *pool, UInt32 size)
+{
+  SInt32 sizeClass = _payloadSizeClass(size);
+  UInt32 capacity = sizeClass < 0 ? size : (UInt32) kPayloadMinPooled << sizeClass;
+  WebMPayload *payload = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (sizeClass >= 0 && pool->freeList[sizeClass] != NULL)
+  {
+    payload = pool->freeList[sizeClass];
+    pool->freeList[sizeClass] = payload->next;
+    pool->cachedBytes -= capacity;
+    pool->hits++;
+    memAccountAdd(kMemPayloadCache, -(SInt64) capacity);
+  }
+  else if (sizeClass >= 0)
+    pool->misses++;
+  else
+    pool->oversize++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (payload == NULL)
+  {
+    //header and data in one block
+    payload = malloc(sizeof(WebMPayload) + capacity);
+    if (payload == NULL)
+      return NULL;
+    payload->sizeClass = sizeClass;
+    payload->capacity = capacity;
+    payload->pool = pool;
+    payload->data = (unsigned char *) (payload + 1);
+    payload->releaseProc = NULL;
+    payload->owner = NULL;
+  }
+
+  payload->refCount = 1;
+  payload->next = NULL;
+  return payload;
+}
+
+WebMPayload *borrowPayload(WebMPayloadPool *pool, void *data, UInt32 size,
+                           WebMPayloadReleaseProc releaseProc, void *owner)
+{
+  WebMPayload *payload;
+
+  pthread_mutex_lock(&pool->mutex);
+  payload = pool->freeBorrowed;
+  if (payload != NULL)
+    pool->freeBorrowed = payload->next;
+  pool->borrowed++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (payload == NULL)
+  {
+    payload = malloc(sizeof(WebMPayload));
+    if (payload == NULL)
+      return NULL;
+  }
+
+  payload->refCount = 1;
+  payload->sizeClass = kPayloadBorrowed;
+  payload->capacity = size;
+  payload->next = NULL;
+  payload->pool = pool;
+  payload->data = data;
+  payload->releaseProc = releaseProc;
+  payload->owner = owner;
+  return payload;
+}
+
+void retainPayload(WebMPayload *payload)
+{
+  __sync_add_and_fetch(&payload->refCount, 1);
+}
+
+void releasePayload(WebMPayload *payload)
+{
+  WebMPayloadPool *pool;
+
+  if (payload == NULL || __sync_sub_and_fetch(&payload->refCount, 1) != 0)
+    return;
+
+  pool = payload->pool;
+
+  if (payload->sizeClass == kPayloadBorrowed)
+  {
+    payload->releaseProc(payload->owner);
+
+    //the header is kept, it is all there is to reuse
+    pthread_mutex_lock(&pool->mutex);
+    payload->next = pool->freeBorrowed;
+    pool->freeBorrowed = payload;
+    pthread_mutex_unlock(&pool->mutex);
+    return;
+  }
+
+  if (payload->sizeClass >= 0)
+  {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->cachedBytes + payload->capacity <= pool->maxCachedBytes)
+    {
+      payload->next = pool->freeList[payload->sizeClass];
+      pool->freeList[payload->sizeClass] = payload;
+      pool->cachedBytes += payload->capacity;
+      memAccountAdd(kMemPayloadCache, payload->capacity);
+      payload = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  free(payload);
+}
+
+void initFrameQueue(WebMQueuedFrames *queue, WebMPayloadPool *pool)
 {
   queue->size =0;
-  queue->maxSize = 0;
-  queue->queue = NULL;
+  queue->slots = 0;
+  queue->head = 0;
+  queue->frames = NULL;
+  queue->capacity = 0;
+  queue->bytes = 0;
+  queue->stalls = 0;
+  queue->budget = NULL;
+  queue->pool = pool;
+}
+
+void setFrameQueueLimits(WebMQueuedFrames *queue, int capacity, WebMFrameBudget *budget)
+{
+  queue->capacity = capacity;
+  queue->budget = budget;
+}
+
+Boolean frameQueueHasRoom(WebMQueuedFrames *queue)
+{
+  if (queue->size == 0)
+    return true;
+  if (queue->capacity != 0 && queue->size >= queue->capacity)
+    return false;
+  return queue->budget == NULL || queue->budget->maxBytes == 0 ||
+         queue->budget->bytes < queue->budget->maxBytes;
 }
 
 WebMBufferedFrame* getFrame(WebMQueuedFrames *queue)
 {
-  return queue->queue[0];
+  if (queue->size <= 0)
+    return NULL;
+  return &queue->frames[queue->head];
 }
 
 void popFrame(WebMQueuedFrames *queue)
@@ -26,36 +209,63 @@ void popFrame(WebMQueuedFrames *queue)
   if (queue->size <=0)
     return;
   WebMBufferedFrame* frame = getFrame(queue);
-  free(frame->data);
-  free(frame);
-  //advance all frames in the queue
-  int i;
-  for (i=1; i < queue->size; i ++)
-    queue->queue[i-1] = queue->queue[i];
+  queue->bytes -= frame->size;
+  memAccountAdd(kMemFrameQueues, -(SInt64) frame->size);
+  if (queue->budget != NULL)
+    queue->budget->bytes -= frame->size;
+  releasePayload(frame->payload);
+  frame->payload = NULL;
+  frame->data = NULL;
+  queue->head = (queue->head + 1) & (queue->slots - 1);
   queue->size -=1;
+}
+
+//doubles the ring, the frames are unwrapped to start at slot 0
+static int _growFrameQueue(WebMQueuedFrames *queue)
+{
+  int slots = queue->slots ? queue->slots * 2 : kInitialFrameSlots;
+  WebMBufferedFrame *frames = malloc(slots * sizeof(WebMBufferedFrame));
+  int i;
 
+  if (frames == NULL)
+    return -1;
+
+  for (i = 0; i < queue->size; i++)
+    frames[i] = queue->frames[(queue->head + i) & (queue->slots - 1)];
+
+  free(queue->frames);
+  memAccountAdd(kMemFrameQueues, (SInt64) (slots - queue->slots) * sizeof(WebMBufferedFrame));
+  queue->frames = frames;
+  queue->slots = slots;
+  queue->head = 0;
+  return 0;
 }
 
-int addFrameToQueue(WebMQueuedFrames *queue, void * data, UInt32 dataSize,
+int addFrameToQueue(WebMQueuedFrames *queue, WebMPayload *payload, UInt32 offset, UInt32 dataSize,
                     UInt64 timeMs, UInt16 frameType, UInt32 indx)
 {
-  if (queue->size +1 > queue->maxSize)
+  if (queue->size == queue->slots && _growFrameQueue(queue) != 0)
   {
-    queue->maxSize += 1;
-    queue->queue = realloc(queue->queue, (queue->maxSize) * sizeof(WebMBufferedFrame));
-  }
-  WebMBufferedFrame * frame = malloc(sizeof(WebMBufferedFrame));
-  if (frame == NULL)
+    releasePayload(payload);
     return -1;
-  frame->data = data;
+  }
+  WebMBufferedFrame * frame = &queue->frames[(queue->head + queue->size) & (queue->slots - 1)];
+  frame->payload = payload;
+  frame->data = payload->data + offset;
   frame->size = dataSize;
   frame->timeMs = timeMs;
   frame->frameType = frameType;
   frame->indx = indx;
 
-  queue->queue[queue->size] = frame;
-
   queue->size += 1;
+  queue->bytes += dataSize;
+  memAccountAdd(kMemFrameQueues, dataSize);
+  if (queue->budget != NULL)
+  {
+    queue->budget->bytes += dataSize;
+    if (queue->budget->bytes > queue->budget->peakBytes)
+      queue->budget->peakBytes = queue->budget->bytes;
+  }
   return 0;
 }
 
@@ -68,7 +278,187 @@ int freeFrameQueue(WebMQueuedFrames *queue)
 {
   while(queue->size > 0)
     popFrame(queue);
-  free(queue->queue);
+  free(queue->frames);
+  memAccountAdd(kMemFrameQueues, -(SInt64) queue->slots * sizeof(WebMBufferedFrame));
+  queue->frames = NULL;
+  queue->slots = 0;
+  queue->head = 0;
+}
+
+void initCueTable(WebMCueTable *cues)
+{
+  cues->timeMs = NULL;
+  cues->clusterPos = NULL;
+  cues->blockNumber = NULL;
+  cues->track = NULL;
+  cues->count = 0;
+  cues->capacity = 0;
+}
+
+int addCueToTable(WebMCueTable *cues, UInt64 timeMs, UInt64 clusterPos, UInt32 blockNumber, UInt32 track)
+{
+  if (cues->count == cues->capacity)
+  {
+    UInt32 capacity = cues->capacity ? cues->capacity * 2 : 256;
+    //64 bit columns first so every column stays aligned
+    char *block = malloc(capacity * kCueRowBytes);
+    if (block == NULL)
+      return -1;
+
+    UInt64 *newTime = (UInt64 *) block;
+    UInt64 *newPos = newTime + capacity;
+    UInt32 *newBlock = (UInt32 *) (newPos + capacity);
+    UInt32 *newTrack = newBlock + capacity;
+
+    if (cues->count > 0)
+    {
+      memcpy(newTime, cues->timeMs, cues->count * sizeof(UInt64));
+      memcpy(newPos, cues->clusterPos, cues->count * sizeof(UInt64));
+      memcpy(newBlock, cues->blockNumber, cues->count * sizeof(UInt32));
+      memcpy(newTrack, cues->track, cues->count * sizeof(UInt32));
+    }
+    free(cues->timeMs);  //start of the old block
+    memAccountAdd(kMemCues, (SInt64) (capacity - cues->capacity) * kCueRowBytes);
+
+    cues->timeMs = newTime;
+    cues->clusterPos = newPos;
+    cues->blockNumber = newBlock;
+    cues->track = newTrack;
+    cues->capacity = capacity;
+  }
+
+  cues->timeMs[cues->count] = timeMs;
+  cues->clusterPos[cues->count] = clusterPos;
+  cues->blockNumber[cues->count] = blockNumber;
+  cues->track[cues->count] = track;
+  cues->count += 1;
+  return 0;
+}
+
+void freeCueTable(WebMCueTable *cues)
+{
+  free(cues->timeMs);
+  memAccountAdd(kMemCues, -(SInt64) cues->capacity * kCueRowBytes);
+  initCueTable(cues);
+}
+
+int initInterleaver(WebMInterleaver *il, UInt32 streamCount)
+{
+  UInt32 i;
+  il->heap = NULL;
+  il->slot = NULL;
+  il->waiting = NULL;
+  il->count = 0;
+  il->waitingCount = streamCount;
+  il->streamCount = streamCount;
+  if (streamCount == 0)
+    return 0;
+
+  il->heap = malloc(streamCount * sizeof(WebMInterleaveEntry));
+  il->slot = malloc(streamCount * sizeof(UInt32));
+  il->waiting = malloc(streamCount * sizeof(UInt32));
+  if (il->heap == NULL || il->slot == NULL || il->waiting == NULL)
+  {
+    freeInterleaver(il);
+    return -1;
+  }
+
+  for (i = 0; i < streamCount; i++)
+  {
+    il->slot[i] = kInterleaveNotQueued;
+    il->waiting[i] = streamCount - 1 - i;  //taken from the end, so stream 0 is refilled first
+  }
+  return 0;
+}
+
+void freeInterleaver(WebMInterleaver *il)
+{
+  free(il->heap);
+  free(il->slot);
+  free(il->waiting);
+  il->heap = NULL;
+  il->slot = NULL;
+  il->waiting = NULL;
+  il->count = 0;
+  il->waitingCount = 0;
+}
+
+static Boolean _interleaveBefore(const WebMInterleaveEntry *a, const WebMInterleaveEntry *b)
+{
+  if (a->timeMs != b->timeMs)
+    return a->timeMs < b->timeMs;
+  if (a->priority != b->priority)
+    return a->priority < b->priority;
+  return a->stream < b->stream;
+}
+
+static void _interleavePlace(WebMInterleaver *il, UInt32 i, WebMInterleaveEntry entry)
+{
+  il->heap[i] = entry;
+  il->slot[entry.stream] = i;
+}
+
+//moves the entry at i up or down until the heap is ordered again
+static void _interleaveSift(WebMInterleaver *il, UInt32 i)
+{
+  WebMInterleaveEntry entry = il->heap[i];
+
+  while (i > 0 && _interleaveBefore(&entry, &il->heap[(i - 1) / 2]))
+  {
+    _interleavePlace(il, i, il->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+
+  while (2 * i + 1 < il->count)
+  {
+    UInt32 child = 2 * i + 1;
+    if (child + 1 < il->count && _interleaveBefore(&il->heap[child + 1], &il->heap[child]))
+      child++;
+    if (!_interleaveBefore(&il->heap[child], &entry))
+      break;
+    _interleavePlace(il, i, il->heap[child]);
+    i = child;
+  }
+
+  _interleavePlace(il, i, entry);
+}
+
+void interleaverSet(WebMInterleaver *il, UInt32 stream, UInt64 timeMs, UInt32 priority)
+{
+  WebMInterleaveEntry entry;
+  UInt32 i = il->slot[stream];
+
+  entry.timeMs = timeMs;
+  entry.priority = priority;
+  entry.stream = stream;
+
+  if (i == kInterleaveNotQueued)
+    i = il->count++;
+  il->heap[i] = entry;
+  _interleaveSift(il, i);
+}
+
+void interleaverRemove(WebMInterleaver *il, UInt32 stream)
+{
+  UInt32 i = il->slot[stream];
+
+  if (i == kInterleaveNotQueued)
+    return;
+
+  il->slot[stream] = kInterleaveNotQueued;
+  il->count -= 1;
+  if (i < il->count)
+  {
+    il->heap[i] = il->heap[il->count];
+    _interleaveSift(il, i);
+  }
+}
+
+SInt32 interleaverTop(WebMInterleaver *il)
+{
+  if (il->count == 0)
+    return -1;
+  return il->heap[0].stream;
 }
 
 void initMovieGetParams(StreamSource *source)
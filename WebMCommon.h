@@ -22,6 +22,7 @@
 #endif /* TARGET_OS_WIN32 */
 
 #endif /* __APPLE_CC__ */
+#include <pthread.h>
 
 typedef struct
 {
@@ -37,23 +38,82 @@ enum{
   ALT_REF_FRAME = 0x08
 };
 
+//Reference counted frame payloads.  Sizes up to kPayloadMaxPooled come from
+//power-of-two size classes starting at kPayloadMinPooled, whose released
+//buffers are kept for reuse up to maxCachedBytes; larger ones are plain
+//allocations.  A payload can also borrow memory owned by someone else, e.g.
+//a retained ICMEncodedFrame, which is handed back through releaseProc.
+//Retain and release are atomic, the pool has its own lock.
+#define kPayloadMinPooledShift 8
+#define kPayloadSizeClasses 15
+#define kPayloadMinPooled (1 << kPayloadMinPooledShift)
+#define kPayloadMaxPooled (kPayloadMinPooled << (kPayloadSizeClasses - 1))
+#define kPayloadUnpooled -1
+#define kPayloadBorrowed -2
+
+typedef void (*WebMPayloadReleaseProc)(void *owner);
+
+struct WebMPayloadPool;
+
+typedef struct WebMPayload
+{
+  SInt32 refCount;
+  SInt32 sizeClass;  //kPayloadUnpooled or kPayloadBorrowed outside the size classes
+  UInt32 capacity;
+  struct WebMPayload *next;  //free list link while cached
+  struct WebMPayloadPool *pool;
+  unsigned char *data;
+  WebMPayloadReleaseProc releaseProc;  //borrowed payloads only
+  void *owner;
+} WebMPayload;
+
+typedef struct WebMPayloadPool
+{
+  WebMPayload *freeList[kPayloadSizeClasses];
+  WebMPayload *freeBorrowed;  //headers of released borrowed payloads
+  UInt64 cachedBytes;
+  UInt64 maxCachedBytes;
+  UInt64 hits;      //served from a free list
+  UInt64 misses;    //pooled size class, newly allocated
+  UInt64 oversize;  //larger than kPayloadMaxPooled
+  UInt64 borrowed;  //wrapped without copying
+  pthread_mutex_t mutex;
+} WebMPayloadPool;
+
 typedef struct
 {
-  void *data;
+  void *data;  //payload->data plus the offset the frame starts at
   UInt32 size;
-  UInt32 offset; //pointer to the end of output buffers data.
+  WebMPayload *payload;  //one reference held by the queue
   UInt64 timeMs; //time in milliseconds
   UInt16 frameType;  //corresponds to above frame types
   UInt32 indx;
 } WebMBufferedFrame;
 
 
-//these frames should be queued chronologically
+//Payload bytes held by the frame queues of all streams in an export.  An
+//encoder callback has nowhere else to put a frame, so this is not a hard cap:
+//producers check frameQueueHasRoom before asking for more.
+typedef struct
+{
+  UInt64 maxBytes;  //0 for no limit
+  UInt64 bytes;
+  UInt64 peakBytes;
+} WebMFrameBudget;
+
+//these frames should be queued chronologically.  A ring of frame records
+//whose slot count is a power of two, doubled when full.
 typedef struct
 {
-  WebMBufferedFrame** queue;
-  int maxSize;  //the maximum allocated memory
+  WebMBufferedFrame* frames;
+  int slots;  //allocated frame records
+  int head;   //oldest frame
   int size;
+  int capacity;  //frames a producer may queue ahead, 0 for no limit
+  UInt64 bytes;  //payload bytes queued
+  UInt64 stalls;  //times the producer was held back by capacity or budget
+  WebMFrameBudget *budget;  //shared by the streams of an export, may be NULL
+  WebMPayloadPool *pool;  //producers allocate their payloads here
 } WebMQueuedFrames;
 
 
@@ -70,15 +130,80 @@ typedef struct
 } StreamSource;
 
 
+//cue points kept as parallel arrays in one allocation that doubles when full
+typedef struct
+{
+  UInt64 *timeMs;
+  UInt64 *clusterPos;  //relative to the first level 1 element
+  UInt32 *blockNumber;
+  UInt32 *track;
+  UInt32 count;
+  UInt32 capacity;
+} WebMCueTable;
+
+//k-way merge of the stream queues: a min-heap of the streams that have a
+//frame queued, ordered by head frame time, then priority, then stream index
+typedef struct
+{
+  UInt64 timeMs;
+  UInt32 priority;
+  UInt32 stream;
+} WebMInterleaveEntry;
+
+#define kInterleaveNotQueued 0xFFFFFFFF
 
-void initFrameQueue(WebMQueuedFrames *queue);
+typedef struct
+{
+  WebMInterleaveEntry *heap;
+  UInt32 *slot;        //heap index of each stream, kInterleaveNotQueued if absent
+  UInt32 *waiting;     //streams whose queue has to be refilled before muxing on
+  UInt32 count;        //entries in heap
+  UInt32 waitingCount;
+  UInt32 streamCount;
+} WebMInterleaver;
+
+
+int initPayloadPool(WebMPayloadPool *pool, UInt64 maxCachedBytes);
+//frees the cached buffers, payloads still referenced stay valid
+void freePayloadPool(WebMPayloadPool *pool);
+//refCount 1 and at least size bytes, NULL on memory error
+WebMPayload *allocPayload(WebMPayloadPool *pool, UInt32 size);
+//refCount 1, releaseProc(owner) runs once the last reference is released
+WebMPayload *borrowPayload(WebMPayloadPool *pool, void *data, UInt32 size,
+                           WebMPayloadReleaseProc releaseProc, void *owner);
+void retainPayload(WebMPayload *payload);
+void releasePayload(WebMPayload *payload);
+
+void initFrameQueue(WebMQueuedFrames *queue, WebMPayloadPool *pool);
+//oldest frame, NULL when empty; valid until the queue is next changed
 WebMBufferedFrame* getFrame(WebMQueuedFrames *queue);
 void popFrame(WebMQueuedFrames *queue);
 // returns -1 on memory error
-int addFrameToQueue(WebMQueuedFrames *queue, void * data,UInt32 size, UInt64 timeMs, UInt16 frameType, UInt32 indx);
+//queues size bytes at offset into payload, taking over the caller's reference
+//(released if the frame cannot be queued)
+int addFrameToQueue(WebMQueuedFrames *queue, WebMPayload *payload, UInt32 offset, UInt32 size,
+                    UInt64 timeMs, UInt16 frameType, UInt32 indx);
 int frameQueueSize(WebMQueuedFrames *queue);
+void setFrameQueueLimits(WebMQueuedFrames *queue, int capacity, WebMFrameBudget *budget);
+//false once the queue is at capacity or the budget is spent.  An empty queue
+//always has room, the muxer cannot go on without its next frame.
+Boolean frameQueueHasRoom(WebMQueuedFrames *queue);
 int freeFrameQueue(WebMQueuedFrames *queue);
 
+void initCueTable(WebMCueTable *cues);
+// returns -1 on memory error
+int addCueToTable(WebMCueTable *cues, UInt64 timeMs, UInt64 clusterPos, UInt32 blockNumber, UInt32 track);
+void freeCueTable(WebMCueTable *cues);
+
+// returns -1 on memory error, every stream starts out waiting
+int initInterleaver(WebMInterleaver *il, UInt32 streamCount);
+void freeInterleaver(WebMInterleaver *il);
+//adds the stream or moves it to its new head frame time, O(log N)
+void interleaverSet(WebMInterleaver *il, UInt32 stream, UInt64 timeMs, UInt32 priority);
+void interleaverRemove(WebMInterleaver *il, UInt32 stream);
+//stream with the earliest head frame, -1 if none is queued
+SInt32 interleaverTop(WebMInterleaver *il);
+
 void initMovieGetParams(StreamSource *get);
 void dbg_printDataParams(StreamSource *get);
 ComponentResult initStreamSource(StreamSource *source,  TimeScale scale,
@@ -17,6 +17,8 @@
 #include "log.h"
 #include "quicktime_util.h"
 #include "WebMExportStructs.h"
+#include "WebMMux.h"
+#include "EbmlAsyncSink.h"
 #include "WebMExportVersions.h"
 #include "VP8CodecVersion.h"
 #include "WebMExport.h"
@@ -51,6 +53,10 @@ static ComponentResult _getFrameRate(Movie theMovie, double *fps);
 
 static ComponentResult getMovieDimensions(Movie theMovie, Fixed *width, Fixed *height);
 
+static ComponentResult _insertClusterPolicy(QTAtomContainer ac, const WebMClusterPolicy *policy);
+
+static ComponentResult _readClusterPolicy(QTAtomContainer settings, WebMClusterPolicy *policy);
+
 
 #define CALLCOMPONENT_BASENAME()        WebMExport
 #define CALLCOMPONENT_GLOBALS()         WebMExportGlobalsPtr storage
@@ -93,6 +99,19 @@ pascal ComponentResult WebMExportOpen(WebMExportGlobalsPtr store, ComponentInsta
 
     store->bExportVideo = 1;
     store->bExportAudio = 1;
+    store->bLiveMode = 0;
+    store->bAsyncWrite = 0;
+    store->bWriteCRC = 0;
+    store->bFastStart = 0;
+    store->bPassthrough = 1;
+    store->segmentDirectory[0] = '\0';
+    store->segments = NULL;
+    store->clusterPolicy.targetDurationMs = 0;
+    store->clusterPolicy.maxBytes = 8 * 1024 * 1024;
+    store->clusterPolicy.alignToKeyframes = true;
+    store->clusterPolicy.audioOnlyDurationMs = 5000;
+    store->queueCapacity = 16;
+    store->frameBudget.maxBytes = 256 * 1024 * 1024;
 
     store->bAltRefEnabled = 0;
 
@@ -101,8 +120,8 @@ pascal ComponentResult WebMExportOpen(WebMExportGlobalsPtr store, ComponentInsta
     store->videoSettingsCustom = NULL;
     store->streams = NULL;
     store->streamCount = 0;
-    store->cueHandle = NULL;
-    store->cueCount = 0;
+    initCueTable(&store->cues);
+    initPayloadPool(&store->payloadPool, kPayloadPoolCacheBytes);
 
     memset(&store->audioBSD, 0, sizeof(AudioStreamBasicDescription));
 
@@ -145,6 +164,7 @@ pascal ComponentResult WebMExportClose(WebMExportGlobalsPtr store, ComponentInst
       CloseComponent(store->quickTimeMovieExporter);
 
     CloseAllStreams(store);
+    freePayloadPool(&store->payloadPool);
 
     if (store->videoSettingsAtom)
       QTDisposeAtomContainer(store->videoSettingsAtom);
@@ -153,6 +173,7 @@ pascal ComponentResult WebMExportClose(WebMExportGlobalsPtr store, ComponentInst
       QTDisposeAtomContainer(store->audioSettingsAtom);
     if(store->videoSettingsCustom)
       DisposeHandle(store->videoSettingsCustom);
+    freeCueTable(&store->cues);
 
     DisposePtr((Ptr) store);
   }
@@ -344,71 +365,78 @@ bail:
 
 // MovieExportToDataRef
 //      Allows an application to request that data be exported to a data reference.
+typedef struct
+{
+  MovieExportGetPropertyUPP propertyProc;
+  MovieExportGetDataUPP dataProc;
+  void *refCon;
+} WebMSourceProcs;
+
 pascal ComponentResult WebMExportToDataRef(WebMExportGlobalsPtr store, Handle dataRef, OSType dataRefType,
                                            Movie theMovie, Track onlyThisTrack, TimeValue startTime, TimeValue duration)
 {
   TimeScale scale;
-  MovieExportGetPropertyUPP getVideoPropertyProc = NULL;
-  MovieExportGetDataUPP getVideoDataProc = NULL;
-  MovieExportGetPropertyUPP getSoundPropertyProc = NULL;
-  MovieExportGetDataUPP getSoundDataProc = NULL;
-  void *videoRefCon;
-  void *audioRefCon;
-  long trackID;
-  ComponentResult err;
-  Boolean have_sources = false;
+  WebMSourceProcs *sources = NULL;
+  long sourceCount = 0;
+  long trackCount, i;
+  long trackID = 0;
+  ComponentResult err = noErr;
 
   dbg_printf("[WebM -- %08lx] ToDataRef(%d, %ld, %ld)\n", (UInt32) store, onlyThisTrack != NULL, startTime, duration);
   dbg_printf("[WebM] ToDataRef -- bMovieHasAudio %d, bMovieHasVideo %d, bExportAudio %d, bExportVideo %d\n",
              store->bMovieHasAudio, store->bMovieHasVideo, store->bExportAudio, store->bExportVideo);
 
-  if (store->bExportVideo && store->bMovieHasVideo)
-  {
-    err = MovieExportNewGetDataAndPropertiesProcs(store->quickTimeMovieExporter, VideoMediaType, &scale, theMovie,
-                                                  onlyThisTrack, startTime, duration, &getVideoPropertyProc,
-                                                  &getVideoDataProc, &videoRefCon);
-    dbg_printf("[WebM]   # [%08lx] :: ToDataRef() = %ld\n", (UInt32) store, err);
+  //every enabled video and sound track is muxed as its own stream, unless
+  //the caller asked for a single track
+  trackCount = onlyThisTrack ? 1 : GetMovieTrackCount(theMovie);
+  sources = calloc(trackCount > 0 ? trackCount : 1, sizeof(WebMSourceProcs));
+  if (sources == NULL)
+    return mFulErr;
 
-    if (err) goto bail;
+  for (i = 1; i <= trackCount; i++)
+  {
+    Track track = onlyThisTrack ? onlyThisTrack : GetMovieIndTrack(theMovie, i);
+    WebMSourceProcs *source = &sources[sourceCount];
+    OSType mediaType = 0;
 
-    err = MovieExportAddDataSource(store->self, VideoMediaType, scale, &trackID, getVideoPropertyProc, getVideoDataProc, videoRefCon);
-    if (err) goto bail;
-    have_sources = true;
+    if (track == NULL || !GetTrackEnabled(track))
+      continue;
 
-    if (store->framerate == 0)
-      _getFrameRate(theMovie, &store->framerate);
-  }
+    GetMediaHandlerDescription(GetTrackMedia(track), &mediaType, NULL, NULL);
 
-  if (store->bExportAudio && store->bMovieHasAudio)
-  {
-    err = MovieExportNewGetDataAndPropertiesProcs(store->quickTimeMovieExporter, SoundMediaType, &scale, theMovie,
-                                                  onlyThisTrack, startTime, duration, &getSoundPropertyProc,
-                                                  &getSoundDataProc, &audioRefCon);
+    if (mediaType == VideoMediaType && !(store->bExportVideo && store->bMovieHasVideo))
+      continue;
+    if (mediaType == SoundMediaType && !(store->bExportAudio && store->bMovieHasAudio))
+      continue;
+    if (mediaType != VideoMediaType && mediaType != SoundMediaType)
+      continue;
 
-    dbg_printf("[WebM]   = [%08lx] :: ToDataRef() = %ld\n", (UInt32) store, err);
+    err = MovieExportNewGetDataAndPropertiesProcs(store->quickTimeMovieExporter, mediaType, &scale, theMovie,
+                                                  track, startTime, duration, &source->propertyProc,
+                                                  &source->dataProc, &source->refCon);
+    dbg_printf("[WebM]   # [%08lx] :: ToDataRef() track %ld '%4.4s' = %ld\n", (UInt32) store, i, (char *) &mediaType, err);
 
     if (err) goto bail;
-    // ** Add the audio data source **
-    err = MovieExportAddDataSource(store->self, SoundMediaType, scale, &trackID, getSoundPropertyProc, getSoundDataProc, audioRefCon);
+    sourceCount++;
 
+    err = MovieExportAddDataSource(store->self, mediaType, scale, &trackID, source->propertyProc,
+                                   source->dataProc, source->refCon);
     if (err) goto bail;
 
-    have_sources = true;
+    if (mediaType == VideoMediaType && store->framerate == 0)
+      _getFrameRate(theMovie, &store->framerate);
   }
 
-  if (have_sources)
+  if (sourceCount > 0)
     err = MovieExportFromProceduresToDataRef(store->self, dataRef, dataRefType);
   else
     err = invalidMovie;
 
-  if (err) goto bail;
-
-  if (getSoundPropertyProc || getSoundDataProc)
-    MovieExportDisposeGetDataAndPropertiesProcs(store->quickTimeMovieExporter, getSoundPropertyProc, getSoundDataProc, audioRefCon);
-
-  if (getVideoPropertyProc || getVideoDataProc)
-    MovieExportDisposeGetDataAndPropertiesProcs(store->quickTimeMovieExporter, getVideoPropertyProc, getVideoDataProc, videoRefCon);
 bail:
+  for (i = 0; i < sourceCount; i++)
+    MovieExportDisposeGetDataAndPropertiesProcs(store->quickTimeMovieExporter, sources[i].propertyProc,
+                                                sources[i].dataProc, sources[i].refCon);
+  free(sources);
   dbg_printf("[WebM] <   [%08lx] :: ToDataRef() = %d, %ld\n", (UInt32) store, err, trackID);
   return err;
 }
@@ -420,6 +448,12 @@ bail:
 pascal ComponentResult WebMExportFromProceduresToDataRef(WebMExportGlobalsPtr store, Handle dataRef, OSType dataRefType)
 {
   DataHandler    dataH = NULL;
+  EbmlDataHSink  dataHSink;
+  EbmlAsyncSink  asyncSink;
+  EbmlSegmentSink segmentSink;
+  EbmlSink       sink, asyncWriter, segmentWriter;
+  EbmlSink       *output = &sink;
+  Boolean        async = false;
   ComponentResult err;
 
   dbg_printf("[WebM--%08lx] FromProceduresToDataRef()\n", (UInt32) store);
@@ -446,7 +480,46 @@ pascal ComponentResult WebMExportFromProceduresToDataRef(WebMExportGlobalsPtr st
   err = ConfigureQuickTimeMovieExporter(store);
   if (err) goto bail;
 
-  err = muxStreams(store, dataH);
+  Ebml_InitDataHSink(&sink, &dataHSink, dataH);
+
+  //without a writer thread the data handler is simply written synchronously
+  if (store->bAsyncWrite && Ebml_InitAsyncSink(&asyncWriter, &asyncSink, &sink, 0) == 0)
+  {
+    output = &asyncWriter;
+    async = true;
+  }
+
+  //the segment files are copied from the same pass, in front of the file writer
+  if (store->segmentDirectory[0] != '\0')
+  {
+    err = Ebml_InitSegmentSink(&segmentWriter, &segmentSink, output, store->segmentDirectory);
+
+    if (err == noErr)
+    {
+      store->segments = &segmentSink;
+      output = &segmentWriter;
+    }
+  }
+
+  if (err == noErr)
+    err = muxStreams(store, output);
+
+  if (store->segments != NULL)
+  {
+    ComponentResult segmentErr = Ebml_CloseSegmentSink(&segmentSink, 0);
+    store->segments = NULL;
+
+    if (err == noErr)
+      err = segmentErr;
+  }
+
+  if (async)
+  {
+    ComponentResult asyncErr = Ebml_CloseAsyncSink(&asyncSink);
+
+    if (err == noErr)
+      err = asyncErr;
+  }
 
 bail:
 
@@ -514,6 +587,8 @@ pascal ComponentResult WebMExportAddDataSource(WebMExportGlobalsPtr store, OSTyp
 
     GenericStream *gs = &(*store->streams)[store->streamCount-1];
     gs->trackType = trackType;
+    gs->priority = trackType == SoundMediaType ? kWebMAudioPriority : kWebMVideoPriority;
+    gs->passthrough = false;
     StreamSource *source = NULL;
 
     if (trackType == VideoMediaType)
@@ -525,7 +600,7 @@ pascal ComponentResult WebMExportAddDataSource(WebMExportGlobalsPtr store, OSTyp
     {
       initAudioStream(gs);
     }
-    initFrameQueue(&gs->frameQueue);
+    initFrameQueue(&gs->frameQueue, &store->payloadPool);
 
     initStreamSource(&gs->source, scale, *trackIDPtr,  propertyProc,
                      getDataProc, refCon);
@@ -661,6 +736,62 @@ pascal ComponentResult WebMExportGetSettingsAsAtomContainer(WebMExportGlobalsPtr
                         1, 0, sizeof(b_false), &b_false, NULL);
   }
 
+  if (err)
+    goto bail;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsLiveMode,
+                      1, 0, sizeof(Boolean), store->bLiveMode ? &b_true : &b_false, NULL);
+
+  if (err)
+    goto bail;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsAsyncWrite,
+                      1, 0, sizeof(Boolean), store->bAsyncWrite ? &b_true : &b_false, NULL);
+
+  if (err)
+    goto bail;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsWriteCRC,
+                      1, 0, sizeof(Boolean), store->bWriteCRC ? &b_true : &b_false, NULL);
+
+  if (err)
+    goto bail;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsFastStart,
+                      1, 0, sizeof(Boolean), store->bFastStart ? &b_true : &b_false, NULL);
+
+  if (err)
+    goto bail;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsPassthrough,
+                      1, 0, sizeof(Boolean), store->bPassthrough ? &b_true : &b_false, NULL);
+
+  if (err)
+    goto bail;
+
+  {
+    UInt32 queueCapacity = EndianU32_NtoB(store->queueCapacity);
+    UInt32 queueBudget = EndianU32_NtoB((UInt32) store->frameBudget.maxBytes);
+
+    err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsQueueCapacity,
+                        1, 0, sizeof(queueCapacity), &queueCapacity, NULL);
+
+    if (!err)
+      err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsQueueBudget,
+                          1, 0, sizeof(queueBudget), &queueBudget, NULL);
+  }
+
+  if (err)
+    goto bail;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsSegmentDirectory,
+                      1, 0, strlen(store->segmentDirectory), store->segmentDirectory, NULL);
+
+  if (err)
+    goto bail;
+
+  err = _insertClusterPolicy(ac, &store->clusterPolicy);
+
   if (err)
     goto bail;
 
@@ -768,6 +899,113 @@ pascal ComponentResult WebMExportSetSettingsFromAtomContainer(WebMExportGlobalsP
     dbg_printf("[webM] setsettingsFromAtomContainer store->bExportAudio = %d\n", store->bExportAudio);
   }
 
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsLiveMode, 1, NULL);
+
+  if (atom)
+  {
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(tmp), &tmp, NULL);
+
+    if (err)
+      goto bail;
+
+    store->bLiveMode = tmp;
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsAsyncWrite, 1, NULL);
+
+  if (atom)
+  {
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(tmp), &tmp, NULL);
+
+    if (err)
+      goto bail;
+
+    store->bAsyncWrite = tmp;
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsWriteCRC, 1, NULL);
+
+  if (atom)
+  {
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(tmp), &tmp, NULL);
+
+    if (err)
+      goto bail;
+
+    store->bWriteCRC = tmp;
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsFastStart, 1, NULL);
+
+  if (atom)
+  {
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(tmp), &tmp, NULL);
+
+    if (err)
+      goto bail;
+
+    store->bFastStart = tmp;
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsPassthrough, 1, NULL);
+
+  if (atom)
+  {
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(tmp), &tmp, NULL);
+
+    if (err)
+      goto bail;
+
+    store->bPassthrough = tmp;
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsQueueCapacity, 1, NULL);
+
+  if (atom)
+  {
+    UInt32 value;
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(value), &value, NULL);
+
+    if (err)
+      goto bail;
+
+    store->queueCapacity = EndianU32_BtoN(value);
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsQueueBudget, 1, NULL);
+
+  if (atom)
+  {
+    UInt32 value;
+    err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(value), &value, NULL);
+
+    if (err)
+      goto bail;
+
+    store->frameBudget.maxBytes = EndianU32_BtoN(value);
+  }
+
+  atom = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsSegmentDirectory, 1, NULL);
+
+  if (atom)
+  {
+    long pathLength = 0;
+
+    //an empty atom turns segmented output off
+    err = QTCopyAtomDataToPtr(settings, atom, true, sizeof(store->segmentDirectory) - 1,
+                              store->segmentDirectory, &pathLength);
+
+    if (err)
+      goto bail;
+
+    store->segmentDirectory[pathLength] = '\0';
+  }
+
+  err = _readClusterPolicy(settings, &store->clusterPolicy);
+
+  if (err)
+    goto bail;
+
   atom = QTFindChildByID(settings, kParentAtomIsContainer, kQTSettingsVideo, 1, NULL);
 
   if (atom)
@@ -942,3 +1180,70 @@ static ComponentResult _getFrameRate(Movie theMovie, double *fps)
   return noErr;
 }
 
+static ComponentResult _insertClusterPolicy(QTAtomContainer ac, const WebMClusterPolicy *policy)
+{
+  QTAtom parent;
+  UInt32 targetDurationMs = EndianU32_NtoB(policy->targetDurationMs);
+  UInt32 maxBytes = EndianU32_NtoB(policy->maxBytes);
+  UInt32 audioOnlyDurationMs = EndianU32_NtoB(policy->audioOnlyDurationMs);
+  Boolean alignToKeyframes = policy->alignToKeyframes;
+  ComponentResult err;
+
+  err = QTInsertChild(ac, kParentAtomIsContainer, kWebMSettingsClusterPolicy, 1, 0, 0, NULL, &parent);
+
+  if (!err)
+    err = QTInsertChild(ac, parent, kWebMClusterTargetDuration, 1, 0,
+                        sizeof(targetDurationMs), &targetDurationMs, NULL);
+
+  if (!err)
+    err = QTInsertChild(ac, parent, kWebMClusterMaxBytes, 1, 0, sizeof(maxBytes), &maxBytes, NULL);
+
+  if (!err)
+    err = QTInsertChild(ac, parent, kWebMClusterAlignToKeyframes, 1, 0,
+                        sizeof(alignToKeyframes), &alignToKeyframes, NULL);
+
+  if (!err)
+    err = QTInsertChild(ac, parent, kWebMClusterAudioOnlyDuration, 1, 0,
+                        sizeof(audioOnlyDurationMs), &audioOnlyDurationMs, NULL);
+
+  return err;
+}
+
+//fields missing from the atom keep their current value
+static ComponentResult _readClusterPolicy(QTAtomContainer settings, WebMClusterPolicy *policy)
+{
+  QTAtom parent, atom;
+  UInt32 value;
+  Boolean flag;
+  ComponentResult err = noErr;
+
+  parent = QTFindChildByID(settings, kParentAtomIsContainer, kWebMSettingsClusterPolicy, 1, NULL);
+
+  if (!parent)
+    return noErr;
+
+  atom = QTFindChildByID(settings, parent, kWebMClusterTargetDuration, 1, NULL);
+
+  if (atom && !(err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(value), &value, NULL)))
+    policy->targetDurationMs = EndianU32_BtoN(value);
+
+  atom = QTFindChildByID(settings, parent, kWebMClusterMaxBytes, 1, NULL);
+
+  if (!err && atom && !(err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(value), &value, NULL)))
+    policy->maxBytes = EndianU32_BtoN(value);
+
+  atom = QTFindChildByID(settings, parent, kWebMClusterAlignToKeyframes, 1, NULL);
+
+  if (!err && atom && !(err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(flag), &flag, NULL)))
+    policy->alignToKeyframes = flag;
+
+  atom = QTFindChildByID(settings, parent, kWebMClusterAudioOnlyDuration, 1, NULL);
+
+  if (!err && atom && !(err = QTCopyAtomDataToPtr(settings, atom, false, sizeof(value), &value, NULL)))
+    policy->audioOnlyDurationMs = EndianU32_BtoN(value);
+
+  if (policy->maxBytes < 64 * 1024)
+    policy->maxBytes = 64 * 1024;  //a cluster has to hold at least one large frame
+
+  return err;
+}
@@ -24,6 +24,7 @@
 
 #endif /* __APPLE_CC__ */
 #include "EbmlDataHWriter.h"
+#include "EbmlSegmentWriter.h"
 #include "WebMCommon.h"
 
 
@@ -31,7 +32,6 @@ typedef struct
 {
   ComponentInstance vorbisComponentInstance;
   AudioStreamBasicDescription asbd;
-  WebMBuffer buf;
 } AudioStream, *AudioStreamPtr;
 
 
@@ -42,8 +42,19 @@ typedef struct
   ICMCompressionSessionRef compressionSession;
   Boolean             bTwoPass;
   UInt32              lastTimeMs;
+  TimeValue64         drainTime;  //display time the encoder has been completed up to at the end, 0 before
 } VideoStream, *VideoStreamPtr;
 
+//default GenericStream priorities: audio goes ahead of video with the same time
+#define kWebMAudioPriority 0
+#define kWebMVideoPriority 1
+
+//released frame payloads kept for reuse by an exporter instance
+#define kPayloadPoolCacheBytes (32 * 1024 * 1024)
+
+//longest path, terminator included, accepted for the segmented output directory
+#define kWebMSegmentDirectoryMax 1024
+
 typedef struct
 {
   OSType           trackType;
@@ -52,6 +63,9 @@ typedef struct
   UInt64 framesIn;
   UInt64 framesOut;
   Boolean complete;
+  UInt32 priority;  //muxed first among frames with the same time when lower
+  SInt64 cueClusterOffset;  //cluster of the last cue written for this stream
+  Boolean passthrough;  //source samples are already VP8/Vorbis and copied as they are
   union
   {
     VideoStream vid;
@@ -59,13 +73,15 @@ typedef struct
   } ;
 } GenericStream, *GenericStreamPtr;
 
+//When a new Cluster is started.  Clusters are always cut before the SInt16
+//block timecode would overflow and before maxBytes would be exceeded.
 typedef struct
 {
-  UInt64 loc;
-  unsigned long timeVal;
-  unsigned int  track;
-  unsigned int blockNumber;
-} WebMCuePoint;
+  UInt32  targetDurationMs;     //0 cuts at every keyframe when aligned
+  UInt32  maxBytes;
+  Boolean alignToKeyframes;     //with video, only cut at keyframes of the first video track
+  UInt32  audioOnlyDurationMs;  //cluster length when there is no video to align to
+} WebMClusterPolicy;
 
 typedef struct
 {
@@ -75,12 +91,13 @@ typedef struct
   int             streamCount;
   GenericStream    **streams;  //should be either audio or video
 
-  unsigned long   cueCount;
-  Handle          cueHandle;
+  WebMCueTable    cues;
 
   MovieProgressUPP   progressProc;
   long               progressRefCon;
   Boolean            progressOpen;
+  unsigned long      progressLastTicks;
+  double             progressLastPercent;
 
   Boolean            canceled;
   Boolean            startNewCluster;
@@ -92,6 +109,16 @@ typedef struct
   /* settings */
   Boolean             bExportVideo;
   Boolean             bExportAudio;
+  Boolean             bLiveMode;        //unknown-size Segment, never seeks
+  Boolean             bAsyncWrite;      //data handler writes happen on a background thread
+  Boolean             bWriteCRC;        //CRC-32 first child in Info, Tracks, Clusters and Cues
+  Boolean             bFastStart;       //Cues reserved right after Tracks
+  Boolean             bPassthrough;     //copy VP8 and Vorbis sources instead of transcoding
+  char                segmentDirectory[kWebMSegmentDirectoryMax];  //POSIX path for segmented output, empty for none
+  WebMClusterPolicy   clusterPolicy;
+  UInt32              queueCapacity;    //frames a stream may queue ahead of the muxer, 0 for no limit
+  WebMFrameBudget     frameBudget;      //maxBytes is a setting, the rest is reset per export
+  WebMPayloadPool     payloadPool;      //frame payloads of every stream
 
   Boolean             bAltRefEnabled;
 
@@ -100,6 +127,8 @@ typedef struct
   //Ebml writing
   unsigned long clusterTime;
   unsigned long clusterKeyFrameTime;
+  SInt32 clusterKeyStream;  //video stream clusters align to, -1 for none
+  EbmlSegmentSink *segments;  //set while muxing to segmentDirectory
   EbmlLoc clusterStart;
   unsigned int blocksInCluster;  //this increments any time a block added
   SInt64 clusterOffset;
@@ -23,4 +23,20 @@
 
 #define kAudioFormatXiphVorbis             'XiVs'
 
+//exporter specific settings atoms
+#define kWebMSettingsLiveMode              'live'   //Boolean, stream friendly output that never seeks
+#define kWebMSettingsAsyncWrite            'asyn'   //Boolean, write the file from a background thread
+#define kWebMSettingsWriteCRC              'crc '   //Boolean, CRC-32 elements in the level 1 elements
+#define kWebMSettingsFastStart             'fast'   //Boolean, Cues ahead of the first Cluster
+#define kWebMSettingsPassthrough           'pass'   //Boolean, mux VP8 and Vorbis sources without transcoding
+#define kWebMSettingsQueueCapacity         'qcap'   //UInt32 big endian, frames queued per stream, 0 for no limit
+#define kWebMSettingsQueueBudget           'qmem'   //UInt32 big endian, bytes queued across streams, 0 for no limit
+#define kWebMSettingsClusterPolicy         'clus'   //container for the cluster cutting policy:
+#define kWebMClusterTargetDuration         'cdur'   //  UInt32 big endian, milliseconds
+#define kWebMClusterMaxBytes               'cmax'   //  UInt32 big endian
+#define kWebMClusterAlignToKeyframes       'ckey'   //  Boolean
+#define kWebMClusterAudioOnlyDuration      'caud'   //  UInt32 big endian, milliseconds
+#define kWebMSettingsSegmentDirectory      'sdir'   //UTF-8 POSIX path without terminator, also writes
+                                                    //init.webm, segment-NNNNN.webm and index.csv there
+
 #endif /* __WebMExport_versions_h__ */
@@ -43,6 +43,7 @@
 
 #include "keystone_util.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 
 
 typedef std::vector<SampleReferenceRecord> SampleRefVec;
@@ -103,6 +104,8 @@ typedef struct {
   int import_state;
   // Reader object passed to libwebm's mkvparser.
   MkvBufferedReaderQT* reader;
+  // Capacity of the sample vectors counted as kMemImportSamples, in bytes.
+  SInt64 sampleBytesAccounted;
 } WebMImportGlobalsRec, *WebMImportGlobals;
 
 namespace {
@@ -165,6 +168,7 @@ extern "C" {
 }
 
 static void ResetState(WebMImportGlobals store);
+static void AccountSampleMemory(WebMImportGlobals store);
 static int ParseDataHeaders(WebMImportGlobals store);
 static int ParseDataCluster(WebMImportGlobals store);
 OSErr CreateVP8ImageDescription(long width, long height,
@@ -287,6 +291,7 @@ pascal ComponentResult WebMImportDataRef(WebMImportGlobals store,
   ComponentResult status = noErr;
 
   ResetState(store);
+  memAccountResetPeaks();
   store->movie = theMovie;
   store->loadState = kMovieLoadStateLoading;
   store->import_state = kImportStateParseHeaders;
@@ -469,6 +474,7 @@ pascal ComponentResult WebMImportIdle(WebMImportGlobals store,
     NotifyMovieChanged(store);
 
     DumpWebMGlobals(store);
+    memAccountDump("WebM import");
   }
 
   return noErr;
@@ -596,6 +602,25 @@ static void ResetState(WebMImportGlobals store) {
     delete store->reader;
     store->reader = NULL;
   }
+  // Swap with empty vectors, clear() would keep the capacity.
+  SampleRefVec().swap(store->videoSamples);
+  SampleTimeVec().swap(store->videoTimes);
+  SampleRefVec().swap(store->audioSamples);
+  SampleTimeVec().swap(store->audioTimes);
+  AccountSampleMemory(store);
+}
+
+
+//-----------------------------------------------------------------------------
+// Update the memory accounting after the sample vectors may have grown.
+//
+static void AccountSampleMemory(WebMImportGlobals store) {
+  const SInt64 bytes =
+      (store->videoSamples.capacity() + store->audioSamples.capacity()) *
+          sizeof(SampleReferenceRecord) +
+      (store->videoTimes.capacity() + store->audioTimes.capacity()) *
+          sizeof(long long);
+  memAccountSet(kMemImportSamples, &store->sampleBytesAccounted, bytes);
 }
 
 
@@ -911,6 +936,7 @@ OSErr AddAudioBlock(WebMImportGlobals store, const mkvparser::Block* webmBlock,
     store->audioSamples.push_back(*srp);
     store->audioTimes.push_back(blockTime_ns);
   }
+  AccountSampleMemory(store);
 
   return err;
 }
@@ -1157,6 +1183,7 @@ OSErr AddVideoBlock(WebMImportGlobals store, const mkvparser::Block* webmBlock,
     store->videoSamples.push_back(*srp);
     store->videoTimes.push_back(blockTime_ns);
   }
+  AccountSampleMemory(store);
 
   return err;
 }
@@ -1443,6 +1470,7 @@ static ComponentResult NonIdleImport(WebMImportGlobals store) {
   NotifyMovieChanged(store);
 
   DumpWebMGlobals(store);
+  memAccountDump("WebM import");
   return noErr;
 }
 
@@ -13,12 +13,31 @@
 //#include "debug.h"
 
 #include "EbmlIDs.h"
+#include "EbmlWriter.h"
+#include "EbmlEncode.h"
+#include "WebMElement.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 #include "WebMAudioStream.h"
+#include "WebMVideoStream.h"
 #include "WebMMux.h"
 
 #define kVorbisPrivateMaxSize  4000
 #define kSInt16Max 32768
+//space reserved after the Segment header, filled in when the file is finalized
+#define kSeekHeadRegionSize 96
+#define kInfoRegionSize 128
+//fast start Cues reservation: id, size and CRC-32, a typical CuePoint and a cap
+#define kCuesHeaderSize 18
+#define kCuePointSize 24
+//largest CuePoint _writeCues encodes: CuePoint and CueTrackPositions headers
+//of 2 bytes, CueTime, CueTrack and CueClusterPosition of up to 1+1+8 and
+//CueBlockNumber, whose id is 2 bytes, of up to 2+1+8
+#define kCuePointMaxSize (2 + 10 + 2 + 10 + 10 + 11)
+#define kMaxCuesRegionSize (4 * 1024 * 1024)
+//progress callback throttling, TickCount() runs at 60 ticks a second
+#define kProgressIntervalTicks 15
+#define kProgressMinDelta 0.01
 
 static ComponentResult _updateProgressBar(WebMExportGlobalsPtr globals, double percent);
 
@@ -73,7 +92,7 @@ static ComponentResult _writeTracks(WebMExportGlobalsPtr globals, EbmlGlobal *eb
   ComponentResult err = noErr;
   int i;
   {
-    Ebml_StartSubElement(ebml, trackStart, Tracks);
+    Ebml_StartCheckedElement(ebml, trackStart, Tracks);
 
     // Write tracks
     for (i = 0; i < globals->streamCount; i++)
@@ -100,7 +119,7 @@ static ComponentResult _writeTracks(WebMExportGlobalsPtr globals, EbmlGlobal *eb
                    gs->source.trackID, id->width, id->height, fps);
         writeVideoTrack(ebml, gs->source.trackID,
                         0, /*flag lacing*/
-                        "V_VP8", id->width, id->height, fps);
+                        "V_VP8", "VP8", id->width, id->height, fps);
       }
       else if (gs->trackType == SoundMediaType && globals->bCanExportAudio)
       {
@@ -109,16 +128,15 @@ static ComponentResult _writeTracks(WebMExportGlobalsPtr globals, EbmlGlobal *eb
         double sampleRate = 0;
         unsigned int channels = 0;
 
-        if (as->vorbisComponentInstance == NULL)
+        if (!gs->passthrough && as->vorbisComponentInstance == NULL)
         {
           //Here I am setting the input properties for this component
           err = initVorbisComponent(globals, gs);
 
           if (err) return err;
-
-          sampleRate = as->asbd.mSampleRate;
-          channels = as->asbd.mChannelsPerFrame;
         }
+        sampleRate = as->asbd.mSampleRate;
+        channels = as->asbd.mChannelsPerFrame;
 
         UInt8 *privateData = NULL;
         UInt32 privateDataSize = 0;
@@ -126,7 +144,7 @@ static ComponentResult _writeTracks(WebMExportGlobalsPtr globals, EbmlGlobal *eb
         write_vorbisPrivateData(gs, &privateData, &privateDataSize);
         dbg_printf("[WebM] Writing audio track %d with %d bytes private data, %d channels, %d sampleRate\n",
                    gs->source.trackID, privateDataSize, channels, sampleRate);
-        writeAudioTrack(ebml, gs->source.trackID, 0 /*no lacing*/, "A_VORBIS" /*fixed for now*/,
+        writeAudioTrack(ebml, gs->source.trackID, 0 /*no lacing*/, "A_VORBIS", "Vorbis",
                         sampleRate, channels, privateData, privateDataSize);
         dbg_printf("[WebM] finished audio write \n");
 
@@ -134,17 +152,28 @@ static ComponentResult _writeTracks(WebMExportGlobalsPtr globals, EbmlGlobal *eb
           free(privateData);
       }
     }
-    Ebml_EndSubElement(ebml, trackStart);
+    Ebml_EndElement(ebml, trackStart);
   }
   dbg_printf("[webM] exit write trakcs = %d\n", err);
   return err;
 }
 
 
+//Host progress callbacks are throttled to one per kProgressIntervalTicks or
+//kProgressMinDelta of progress, whichever comes first.  A host answering
+//userCanceledErr sets globals->canceled, muxing then stops at the next block
+//and finalizes what was written so far.
 static ComponentResult _updateProgressBar(WebMExportGlobalsPtr globals, double percent)
 {
   ComponentResult err = noErr;
-  //todo -- progress bar might need to be shut off in some cases
+  unsigned long now = TickCount();
+
+  if (globals->progressProc == NULL)
+    return noErr;
+
+  if (percent > 1.0)
+    percent = 1.0;
+
   if (globals->progressOpen == false)
   {
     err = InvokeMovieProgressUPP(NULL, movieProgressOpen,
@@ -153,143 +182,194 @@ static ComponentResult _updateProgressBar(WebMExportGlobalsPtr globals, double p
                                  globals->progressProc);
     globals->progressOpen = true;
   }
+  else if (percent < 1.0 && now - globals->progressLastTicks < kProgressIntervalTicks &&
+           percent - globals->progressLastPercent < kProgressMinDelta)
+    return noErr;
 
-  Fixed percentDone = FloatToFixed(percent);
-
-  if (globals->progressProc)
-  {
-
-    if (percentDone > 0x010000)
-      percentDone = 0x010000;
-
+  if (err == noErr)
     err = InvokeMovieProgressUPP(NULL, movieProgressUpdatePercent,
-                                 progressOpExportMovie, percentDone,
+                                 progressOpExportMovie, FloatToFixed(percent),
                                  globals->progressRefCon,
                                  globals->progressProc);
-  }
+  globals->progressLastTicks = now;
+  globals->progressLastPercent = percent;
 
-  if (percentDone == 100.0 && globals->progressOpen)
+  if (err == userCanceledErr)
   {
-    err = InvokeMovieProgressUPP(NULL, movieProgressClose,
-                                 progressOpExportMovie, 0x010000,
-                                 globals->progressRefCon,
-                                 globals->progressProc);
-    globals->progressOpen == false;
+    dbg_printf("[WebM] export canceled at %f\n", percent);
+    globals->canceled = true;
+    err = noErr;
   }
 
   return err;
 }
 
+static void _closeProgressBar(WebMExportGlobalsPtr globals)
+{
+  if (!globals->progressOpen)
+    return;
+
+  InvokeMovieProgressUPP(NULL, movieProgressClose,
+                         progressOpExportMovie, 0x010000,
+                         globals->progressRefCon,
+                         globals->progressProc);
+  globals->progressOpen = false;
+}
+
 static void _writeSeekElement(EbmlGlobal* ebml, unsigned long binaryId, EbmlLoc* Loc, UInt64 firstL1)
 {
-  UInt64 offset = *(SInt64*)&Loc->offset;
-  offset = offset - firstL1 - 4; //constant 4(the length of the binary id)
+  UInt64 offset = Loc->offset - firstL1;
   dbg_printf("[webm] Writing Element %lx at offset %lld\n", binaryId, offset);
 
   EbmlLoc start;
-  Ebml_StartSubElement(ebml, &start, Seek);
+  Ebml_StartElement(ebml, &start, Seek);
   Ebml_SerializeBinary(ebml, SeekID, binaryId);
   Ebml_SerializeUnsigned64(ebml, SeekPosition, offset);
-  Ebml_EndSubElement(ebml, &start);
+  Ebml_EndElement(ebml, &start);
 }
 
-static void _writeMetaSeekInformation(EbmlGlobal *ebml, EbmlLoc*  trackLoc, EbmlLoc*  cueLoc,
-                                      EbmlLoc*  segmentInformation, EbmlLoc* seekInfoLoc, SInt64 sFirstL1, Boolean firstWrite)
+//queues the SeekHead into the region reserved for it once all positions are known
+static ComponentResult _writeMetaSeekInformation(EbmlGlobal *ebml, EbmlLoc*  trackLoc, EbmlLoc*  cueLoc,
+                                                 EbmlLoc*  segmentInformation, EbmlLoc* seekInfoLoc, SInt64 sFirstL1)
 {
-  EbmlLoc globLoc;
+  EbmlLoc seekHead;
   UInt64 firstL1 = sFirstL1;
-  //the first write is basicly space filler because where these elements are is unknown
-  if (firstWrite)
-  {
-    Ebml_StartSubElement(ebml, seekInfoLoc, SeekHead);
-  }
-  else
-  {
-    Ebml_GetEbmlLoc(ebml, &globLoc);
-    //Adding 8 which is the bytes that tell the size of the subElement
-    SInt64 eightSI = 8;
-    wide eight = *(wide*)&eightSI;
-    WideAdd(&seekInfoLoc->offset, &eight);
-    Ebml_SetEbmlLoc(ebml, seekInfoLoc);
-  }
-  SInt64 seekLoc = *(SInt64*)&seekInfoLoc->offset;
+  SInt64 seekLoc = seekInfoLoc->offset;
   dbg_printf("[webm] Writing Seek Info to %lld\n", seekLoc);
 
+  Ebml_StartPatch(ebml, seekInfoLoc);
+  Ebml_StartElement(ebml, &seekHead, SeekHead);
   _writeSeekElement(ebml, Tracks, trackLoc, firstL1);
   _writeSeekElement(ebml, Cues, cueLoc, firstL1);
   _writeSeekElement(ebml, Info, segmentInformation, firstL1);
+  Ebml_EndElement(ebml, &seekHead);
+  return Ebml_EndPatch(ebml, seekInfoLoc);
+}
 
-  if (firstWrite)
-    Ebml_EndSubElement(ebml, seekInfoLoc);
-  else
-    Ebml_SetEbmlLoc(ebml, &globLoc);
+//queues the segment information into its reserved region, rewritten at the
+//end with the final duration
+static ComponentResult _writeSegmentInformationRegion(WebMExportGlobalsPtr globals, EbmlGlobal *ebml, EbmlLoc *infoRegion,
+                                                      EbmlLoc *segmentInfoLoc, double duration)
+{
+  Ebml_StartPatch(ebml, infoRegion);
+  writeSegmentInformation(ebml, segmentInfoLoc, globals->webmTimeCodeScale, duration);
+  return Ebml_EndPatch(ebml, infoRegion);
+}
+
+//Room for a cue per track every second, or every cluster when clusters are
+//longer.  Too small only costs the fallback to Cues at the end of the file.
+static unsigned long _estimateCuesSize(WebMExportGlobalsPtr globals, double duration)
+{
+  WebMClusterPolicy *policy = &globals->clusterPolicy;
+  double interval = 1.0;
+  double estimate;
+
+  if (policy->targetDurationMs > 1000)
+    interval = policy->targetDurationMs / 1000.0;
+
+  estimate = kCuesHeaderSize + (duration / interval + 1) * globals->streamCount * kCuePointSize;
+  if (estimate > kMaxCuesRegionSize)
+    estimate = kMaxCuesRegionSize;
+  return (unsigned long) estimate;
+}
+
+//id, a one byte size and the value in its minimal width
+static int _encodeUnsignedElement(unsigned char *out, unsigned long id, UInt64 val)
+{
+  int n = Ebml_EncodeID(out, id);
+  n += Ebml_EncodeVIntFixed(out + n, Ebml_UnsignedWidth(val), 1);
+  return n + Ebml_EncodeUnsigned(out + n, val);
 }
 
 static void _writeCues(WebMExportGlobalsPtr globals, EbmlGlobal *ebml, EbmlLoc *cuesLoc)
 {
-  dbg_printf("[webm]_writeCues %d \n", globals->cueCount);
-  HLock(globals->cueHandle);
-  Ebml_StartSubElement(ebml, cuesLoc, Cues);
-  int i = 0;
+  WebMCueTable *cues = &globals->cues;
+  UInt32 i;
+
+  dbg_printf("[webm]_writeCues %d \n", cues->count);
+  Ebml_StartCheckedElement(ebml, cuesLoc, Cues);
 
-  for (i = 0; i < globals->cueCount; i ++)
+  for (i = 0; i < cues->count; i ++)
   {
-    EbmlLoc cueHead;
-    WebMCuePoint *cue = (WebMCuePoint*)(*globals->cueHandle + i * sizeof(WebMCuePoint));
-    dbg_printf("[WebM] Writing Cue track %d time %ld loc %lld\n",
-               cue->track, cue->timeVal, cue->loc);
-    Ebml_StartSubElement(ebml, &cueHead, CuePoint);
-    Ebml_SerializeUnsigned(ebml, CueTime, cue->timeVal);
+    //CuePoint and CueTrackPositions have one byte ids and kCuePointMaxSize
+    //(45) is well under the 126 a one byte size holds, so the whole element
+    //is encoded in place and written at once.  The encoders store 8 bytes.
+    unsigned char cuePoint[kCuePointMaxSize + 8];
+    int n = 2, positionsStart;
+
+    n += _encodeUnsignedElement(cuePoint + n, CueTime, cues->timeMs[i]);
+    n += Ebml_EncodeID(cuePoint + n, CueTrackPositions);
+    positionsStart = ++n;
+    n += _encodeUnsignedElement(cuePoint + n, CueTrack, cues->track[i]);
+    n += _encodeUnsignedElement(cuePoint + n, CueClusterPosition, cues->clusterPos[i]);
+    n += _encodeUnsignedElement(cuePoint + n, CueBlockNumber, cues->blockNumber[i]);
+    cuePoint[positionsStart - 1] = 0x80 | (n - positionsStart);
+    cuePoint[0] = CuePoint;
+    cuePoint[1] = 0x80 | (n - 2);
+    Ebml_Write(ebml, cuePoint, n);
+  }
 
-    EbmlLoc trackLoc;
-    Ebml_StartSubElement(ebml, &trackLoc, CueTrackPositions);
-    //TODO verify trackLoc
-    Ebml_SerializeUnsigned(ebml, CueTrack, cue->track);
-    Ebml_SerializeUnsigned64(ebml, CueClusterPosition, cue->loc);
-    Ebml_SerializeUnsigned(ebml, CueBlockNumber, cue->blockNumber);
-    Ebml_EndSubElement(ebml, &trackLoc);
+  Ebml_EndElement(ebml, cuesLoc);
+}
 
-    Ebml_EndSubElement(ebml, &cueHead);
-  }
+static ComponentResult _addCue(WebMExportGlobalsPtr globals, UInt64 dataLoc, UInt64 time,
+                               unsigned int track)
+{
+  dbg_printf("[webm] _addCue %d time %lld loc %llu track %d blockNum %d\n",
+             globals->cues.count, time, dataLoc, track, globals->blocksInCluster);
+  if (addCueToTable(&globals->cues, time, dataLoc, globals->blocksInCluster, track) != 0)
+    return mFulErr;
+  return noErr;
+}
 
-  Ebml_EndSubElement(ebml, cuesLoc);
-  HUnlock((Handle)globals->cueHandle);
+//every video track gets a cue on each keyframe, audio tracks on their first
+//block in each cluster
+static Boolean _needsCue(WebMExportGlobalsPtr globals, GenericStream *gs, WebMBufferedFrame *frame)
+{
+  if (gs->trackType == VideoMediaType)
+    return (frame->frameType & KEY_FRAME) != 0;
+  return gs->cueClusterOffset != globals->clusterOffset;
 }
 
-void _addCue(WebMExportGlobalsPtr globals, UInt64 dataLoc, unsigned long time,
-             unsigned int track)
+//Clusters are assembled in memory and go out as one write with their exact
+//size, live output included, so muxing a block never seeks.
+static void _endCluster(WebMExportGlobalsPtr globals, EbmlGlobal *ebml)
 {
-  dbg_printf("[webm] _addCue %d time %ld loc %llu track %d blockNum %d\n",
-             globals->cueCount, time, dataLoc, track, globals->blocksInCluster);
-  globals->cueCount ++;
-  long handleSize = sizeof(WebMCuePoint) * globals->cueCount;
+  if (!Ebml_IsBuilding(ebml))
+    return;  //no cluster open yet
 
-  if (globals->cueHandle)
-  {
-    HUnlock(globals->cueHandle);  //important to unlock before moving
-    SetHandleSize(globals->cueHandle, handleSize);
-    HLock(globals->cueHandle);
-  }
-  else
-    globals->cueHandle = NewHandleClear(handleSize);
-
-  WebMCuePoint *newCue = (WebMCuePoint*) (*globals->cueHandle + handleSize - sizeof(WebMCuePoint));
-  newCue->loc = dataLoc;
-  newCue->timeVal = time;
-  newCue->track = track;
-  newCue->blockNumber = globals->blocksInCluster;
-  dbg_printf("[webm] _addCue exit %d time %ld loc %llu track %d blockNum %d\n",
-             globals->cueCount, newCue->timeVal, newCue->loc, newCue->track, newCue->blockNumber);
-  dbg_printf("[WebM] globals->cueHandle Size %d\n", GetHandleSize(globals->cueHandle));
+  Ebml_EndElement(ebml, &globals->clusterStart);
+  if (globals->bLiveMode)
+    Ebml_Flush(ebml);  //hand the finished cluster to the consumer
+}
+
+//a media segment has to start decoding on its own, so the segmented output is
+//only cut where the video stream clusters align to has a keyframe up next
+static Boolean _clusterStartsSegment(WebMExportGlobalsPtr globals)
+{
+  GenericStream *gs;
+
+  if (globals->segments->segmentNumber == 0 || globals->clusterKeyStream < 0)
+    return true;
+
+  gs = &(*globals->streams)[globals->clusterKeyStream];
+  return gs->frameQueue.size > 0 && (getFrame(&gs->frameQueue)->frameType & KEY_FRAME) != 0;
 }
 
 static void _startNewCluster(WebMExportGlobalsPtr globals, EbmlGlobal *ebml)
 {
   dbg_printf("[webm] Starting new cluster at %ld\n", globals->clusterTime);
-  if (globals->clusterTime != 0)  //case of: first cluster (don't end non-existant previous)
-    Ebml_EndSubElement(ebml, &globals->clusterStart);
+  _endCluster(globals, ebml);
 
-  Ebml_StartSubElement(ebml, &globals->clusterStart, Cluster);
+  //the segment sink splits at what it has received, errors surface when it closes
+  if (globals->segments != NULL && _clusterStartsSegment(globals))
+  {
+    Ebml_Flush(ebml);
+    Ebml_CutSegment(globals->segments, globals->clusterTime);
+  }
+
+  globals->clusterOffset = ebml->offset;
+  Ebml_StartCheckedElement(ebml, &globals->clusterStart, Cluster);
   Ebml_SerializeUnsigned(ebml, Timecode, globals->clusterTime);
   globals->blocksInCluster =1;
 }
@@ -370,13 +450,13 @@ ComponentResult _doFirstPass(WebMExportGlobalsPtr globals)
   for (iStream = 0; iStream < globals->streamCount; iStream++)
   {
     GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->trackType == VideoMediaType)
+    if (gs->trackType == VideoMediaType && !gs->passthrough)
     {
       gs->vid.bTwoPass = true;
     }
   }
 
-  while (!allStreamsDone)
+  while (!allStreamsDone && !globals->canceled)
   {
     timeMs = 0;
     allStreamsDone = true;
@@ -385,7 +465,7 @@ ComponentResult _doFirstPass(WebMExportGlobalsPtr globals)
       GenericStream *gs = &(*globals->streams)[iStream];
       StreamSource *source;
 
-      if (gs->trackType == VideoMediaType)
+      if (gs->trackType == VideoMediaType && !gs->passthrough)
       {
         err = compressNextFrame(globals, gs);
         if (!gs->complete)
@@ -403,7 +483,7 @@ ComponentResult _doFirstPass(WebMExportGlobalsPtr globals)
   for (iStream = 0; iStream < globals->streamCount; iStream++)
   {
     GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->trackType == VideoMediaType)
+    if (gs->trackType == VideoMediaType && !gs->passthrough)
     {
       endPass(gs);
       //reset the stream to the start
@@ -412,6 +492,7 @@ ComponentResult _doFirstPass(WebMExportGlobalsPtr globals)
       gs->complete = false;
       gs->framesIn = 0;
       gs->framesOut = 0;
+      gs->vid.drainTime = 0;
 
     }
   }
@@ -419,7 +500,7 @@ ComponentResult _doFirstPass(WebMExportGlobalsPtr globals)
   for (iStream = 0; iStream < globals->streamCount; iStream++)
   {
     GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->trackType == VideoMediaType)
+    if (gs->trackType == VideoMediaType && !gs->passthrough)
     {
       startPass(gs, 2);
     }
@@ -429,21 +510,47 @@ ComponentResult _doFirstPass(WebMExportGlobalsPtr globals)
   return err;
 }
 
-ComponentResult _compressEmptyStreams(WebMExportGlobalsPtr globals)
+static void _requeueStream(WebMExportGlobalsPtr globals, WebMInterleaver *il, UInt32 iStream)
+{
+  GenericStream *gs = &(*globals->streams)[iStream];
+
+  if (gs->frameQueue.size > 0)
+    interleaverSet(il, iStream, getFrame(&gs->frameQueue)->timeMs, gs->priority);
+  else
+  {
+    interleaverRemove(il, iStream);
+    if (!gs->complete)
+      il->waiting[il->waitingCount++] = iStream;
+  }
+}
+
+//Compresses into the streams that ran dry.  Muxing can only go on once none
+//is left waiting, otherwise a later frame could go out ahead of their next one.
+ComponentResult _refillWaitingStreams(WebMExportGlobalsPtr globals, WebMInterleaver *il)
 {
   ComponentResult err = noErr;
-  UInt32 iStream;
-  for (iStream = 0; iStream < globals->streamCount; iStream++)
+  UInt32 i = il->waitingCount;
+
+  while (i-- > 0)
   {
+    UInt32 iStream = il->waiting[i];
     GenericStream *gs = &(*globals->streams)[iStream];
+    Boolean exported = false;
+
     if (gs->trackType == VideoMediaType && globals->bExportVideo)
     {
-      if (gs->frameQueue.size == 0)
+      exported = true;
+      if (gs->passthrough)
+        err = copyNextFrame(globals, gs);
+      else
         err = compressNextFrame(globals, gs);
     }
     if (gs->trackType == SoundMediaType && globals->bExportAudio)
     {
-      if (gs->frameQueue.size == 0)
+      exported = true;
+      if (gs->passthrough)
+        err = copyAudioPacket(gs);
+      else
         err = compressAudio(gs);
     }
     if (err)
@@ -451,101 +558,78 @@ ComponentResult _compressEmptyStreams(WebMExportGlobalsPtr globals)
       dbg_printf("[webm] compress error = %d\n", err);
       goto bail;
     }
-  }
-bail:
-  return err;
-}
-
 
-Boolean _checkAllStreamsComplete(WebMExportGlobalsPtr globals)
-{
-  UInt32 iStream;
-  Boolean allStreamsDone = true;
-  for (iStream = 0; iStream < globals->streamCount; iStream++)
-  {
-    GenericStream *gs = &(*globals->streams)[iStream];
-    if (!gs->complete || gs->frameQueue.size > 0)
+    if (gs->frameQueue.size > 0 || gs->complete || !exported)
     {
-      allStreamsDone = false;
+      il->waiting[i] = il->waiting[--il->waitingCount];
+      if (gs->frameQueue.size > 0)
+        interleaverSet(il, iStream, getFrame(&gs->frameQueue)->timeMs, gs->priority);
     }
   }
-  return allStreamsDone;
+bail:
+  return err;
 }
 
 //If waiting for data, minTimeStream should be null
-ComponentResult _getStreamWithMinTime(WebMExportGlobalsPtr globals, GenericStream **minTimeStream, UInt64* minTimeMs)
+ComponentResult _getStreamWithMinTime(WebMExportGlobalsPtr globals, WebMInterleaver *il,
+                                      GenericStream **minTimeStream, UInt64* minTimeMs)
 {
-  ComponentResult err = noErr;
-  UInt32 iStream;
+  SInt32 iStream = interleaverTop(il);
   *minTimeMs = ULONG_MAX;
   *minTimeStream = NULL;
 
-  //see if there's an empty queue
-  //TODO : this seems as though it shouldn't happen
-  for (iStream = 0; iStream < globals->streamCount; iStream++)
-  {
-    GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->frameQueue.size == 0  && !gs->complete)
-    {
-      return noErr;
-    }
-  }
+  if (il->waitingCount > 0 || iStream < 0)
+    return noErr;
 
-  for (iStream = 0; iStream < globals->streamCount; iStream++)
-  {
-    GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->frameQueue.size == 0 && gs->complete)
-      continue;  //if the stream is complete just continue
-    
-    WebMBufferedFrame* frame = gs->frameQueue.queue[0];
-    dbg_printf("[WebM] %lu Frame Time = %ld\n",iStream, frame->timeMs);
-
-    Boolean bIsSmaller = false;
-    //audio media takes priority if sizes are similar
-    if(gs->trackType == VideoMediaType)
-      bIsSmaller = *minTimeMs > frame->timeMs;
-    else if (gs->trackType == SoundMediaType)
-      bIsSmaller = *minTimeMs >= frame->timeMs;
-    if (bIsSmaller)
-    {
-      *minTimeMs = frame->timeMs;
-      *minTimeStream = gs;
-    }
-  }
+  *minTimeStream = &(*globals->streams)[iStream];
+  *minTimeMs = getFrame(&(*minTimeStream)->frameQueue)->timeMs;
   dbg_printf("[Webm] Stream with smallest time %d(ms) %s\n",
              *minTimeMs,  ((*minTimeStream)->trackType == VideoMediaType) ?"video":"audio");
-bail:
-  return err;
+  return noErr;
 }
 
-void _startClusterIfNeeded(WebMExportGlobalsPtr globals, EbmlGlobal *ebml, UInt32 minTimeMs)
+void _startClusterIfNeeded(WebMExportGlobalsPtr globals, EbmlGlobal *ebml, UInt32 minTimeMs, UInt32 blockSize)
 {
-  UInt32 iStream;
-  if (minTimeMs - globals->clusterTime > 32767)
+  WebMClusterPolicy *policy = &globals->clusterPolicy;
+  UInt32 elapsedMs = minTimeMs - globals->clusterTime;
+
+  if (elapsedMs > 32767)
     globals->startNewCluster = true; //keep in mind the block time offset to the cluster is SInt16
+  if (Ebml_IsBuilding(ebml) && globals->blocksInCluster > 1 &&
+      Ebml_PendingBytes(ebml) + blockSize > policy->maxBytes)
+    globals->startNewCluster = true; //bounds the memory a cluster is assembled in
 
-  //see if there is a video key frame
-  for (iStream = 0; iStream < globals->streamCount; iStream++)
+  if (globals->clusterKeyStream < 0)
   {
-    GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->frameQueue.size ==0 || gs->trackType != VideoMediaType)
-      continue;
-    WebMBufferedFrame* frame = gs->frameQueue.queue[0];
-    if ((frame->frameType & KEY_FRAME != 0) && frame->timeMs != globals->clusterKeyFrameTime)
-    {
-      globals->clusterKeyFrameTime = frame->timeMs;
+    //audio only
+    if (policy->audioOnlyDurationMs != 0 && elapsedMs >= policy->audioOnlyDurationMs)
       globals->startNewCluster = true;
+  }
+  else if (policy->alignToKeyframes)
+  {
+    //cut as soon as the next keyframe is at the head of its queue, so the
+    //audio leading up to it already goes into the new cluster
+    GenericStream *gs = &(*globals->streams)[globals->clusterKeyStream];
+    if (gs->frameQueue.size > 0)
+    {
+      WebMBufferedFrame* frame = getFrame(&gs->frameQueue);
+      if ((frame->frameType & KEY_FRAME) != 0 && frame->timeMs != globals->clusterKeyFrameTime &&
+          elapsedMs >= policy->targetDurationMs)
+      {
+        globals->clusterKeyFrameTime = frame->timeMs;
+        globals->startNewCluster = true;
+      }
     }
   }
+  else if (policy->targetDurationMs != 0 && elapsedMs >= policy->targetDurationMs)
+    globals->startNewCluster = true;
 
-  //TODO make clusters star with video keyframes
   if (globals->startNewCluster)
   {
     globals->clusterTime = minTimeMs;
     globals->blocksInCluster =1;
-    globals->clusterOffset = *(SInt64 *)& ebml->offset;
-    dbg_printf("[WebM] Start new cluster offset %lld time %ld\n", globals->clusterOffset, minTimeMs);
     _startNewCluster(globals, ebml);
+    dbg_printf("[WebM] Start new cluster offset %lld time %ld\n", globals->clusterOffset, minTimeMs);
     globals->startNewCluster = false;
   }
 }
@@ -554,7 +638,7 @@ void _startClusterIfNeeded(WebMExportGlobalsPtr globals, EbmlGlobal *ebml, UInt3
 ComponentResult _writeBlock(WebMExportGlobalsPtr globals, GenericStreamPtr gs, EbmlGlobal* ebml)
 {
   ComponentResult err = noErr;
-  WebMBufferedFrame *frame = gs->frameQueue.queue[0];
+  WebMBufferedFrame *frame = getFrame(&gs->frameQueue);
 
   int isKeyFrame = (frame->frameType & KEY_FRAME) != 0;
   int invisible = (frame->frameType & ALT_REF_FRAME) !=0;
@@ -583,14 +667,14 @@ static void _endSecondPass(WebMExportGlobalsPtr globals)
   for (iStream = 0; iStream < globals->streamCount; iStream++)
   {
     GenericStream *gs = &(*globals->streams)[iStream];
-    if (gs->trackType == VideoMediaType)
+    if (gs->trackType == VideoMediaType && !gs->passthrough)
       endPass(gs);
   }
 }
 
 
 
-ComponentResult muxStreams(WebMExportGlobalsPtr globals, DataHandler data_h)
+ComponentResult muxStreams(WebMExportGlobalsPtr globals, EbmlSink *sink)
 {
   ComponentResult err = noErr;
   UInt64 minTimeMs;
@@ -604,25 +688,74 @@ ComponentResult muxStreams(WebMExportGlobalsPtr globals, DataHandler data_h)
 
   UInt32 iStream;
   Boolean allStreamsDone = false;
+  WebMInterleaver interleaver = {0};
+
+  Boolean encodesVideo = false;
+
+  //sources already in the output codecs are copied, which runs at disk speed
+  for (iStream = 0; iStream < globals->streamCount; iStream++)
+  {
+    GenericStream *gs = &(*globals->streams)[iStream];
+    gs->passthrough = false;
+    if (globals->bPassthrough && gs->trackType == VideoMediaType && globals->bExportVideo)
+      gs->passthrough = canPassthroughVideo(gs);
+    else if (globals->bPassthrough && gs->trackType == SoundMediaType && globals->bExportAudio)
+      gs->passthrough = canPassthroughAudio(gs);
+    if (gs->trackType == VideoMediaType && !gs->passthrough)
+      encodesVideo = true;
+    dbg_printf("[WebM] stream %lu passthrough %d\n", iStream, gs->passthrough);
+  }
+  if (!encodesVideo)
+    bTwoPass = false;  //a first pass only matters to the encoder
 
   //initialize my ebml writing structure
   EbmlGlobal ebml;
-  ebml.data_h = data_h;
-  ebml.offset.hi = 0;
-  ebml.offset.lo = 0;
+  err = Ebml_InitGlobal(&ebml, sink, EBML_WRITE_CACHE_SIZE);
+  if (err) return mFulErr;
+  ebml.useCRC = globals->bWriteCRC;
 
-  EbmlLoc startSegment, trackLoc, cuesLoc, segmentInfoLoc, seekInfoLoc;
+  EbmlLoc startSegment, trackLoc, cuesLoc, segmentInfoLoc, seekInfoLoc, infoRegion, cuesRegion;
+  UInt64 lastTimeMs = 0;
   globals->progressOpen = false;
+  globals->canceled = false;
+  memAccountResetPeaks();
 
 	writeHeader(&ebml);
   dbg_printf("[WebM]) Write segment information\n");
   Ebml_StartSubElement(&ebml, &startSegment, Segment);
-	SInt64 firstL1Offset = *(SInt64*) &ebml.offset;  //The first level 1 element is the offset needed for cuepoints according to Matroska's specs
-  _writeMetaSeekInformation(&ebml, &trackLoc, &cuesLoc, &segmentInfoLoc, &seekInfoLoc, firstL1Offset, true);
+	SInt64 firstL1Offset = ebml.offset;  //The first level 1 element is the offset needed for cuepoints according to Matroska's specs
+
+  if (globals->bLiveMode)
+  {
+    //live output never seeks back: the Segment keeps the unknown size and
+    //there is no SeekHead, Duration or Cues
+    writeSegmentInformation(&ebml, &segmentInfoLoc, globals->webmTimeCodeScale, 0);
+  }
+  else
+  {
+    //SeekHead and Info are patched in when finalizing, Info gets a first version now
+    Ebml_ReserveRegion(&ebml, &seekInfoLoc, kSeekHeadRegionSize);
+    Ebml_ReserveRegion(&ebml, &infoRegion, kInfoRegionSize);
+    err = _writeSegmentInformationRegion(globals, &ebml, &infoRegion, &segmentInfoLoc, duration);
+    if (err) goto bail;
+    err = Ebml_ApplyPatches(&ebml);
+    if (err) goto bail;
+  }
 
-  writeSegmentInformation(&ebml, &segmentInfoLoc, globals->webmTimeCodeScale, duration);
   _writeTracks(globals, &ebml, &trackLoc);
 
+  //fast start: Cues go right after Tracks so players can seek without
+  //fetching the end of the file
+  if (!globals->bLiveMode && globals->bFastStart)
+    Ebml_ReserveRegion(&ebml, &cuesRegion, _estimateCuesSize(globals, duration));
+
+  //consumers can start decoding as soon as they have the header
+  if (globals->bLiveMode)
+  {
+    err = Ebml_Flush(&ebml);
+    if (err) goto bail;
+  }
+
   Boolean bExportVideo = globals->bMovieHasVideo && globals->bExportVideo;
   Boolean bExportAudio = globals->bMovieHasAudio && globals->bExportAudio;
 
@@ -635,48 +768,69 @@ ComponentResult muxStreams(WebMExportGlobalsPtr globals, DataHandler data_h)
   globals->clusterTime = 0;  //assuming 0 start time
   globals->startNewCluster = true;  //cluster should start very first
   globals->blocksInCluster =1;
-  globals->clusterOffset = *(SInt64 *)& ebml.offset;
+  globals->clusterOffset = ebml.offset;
   globals->clusterKeyFrameTime = UINT_MAX;
+  globals->cues.count = 0;  //drop cues of an earlier export from this instance
+  globals->clusterKeyStream = -1;
+  globals->frameBudget.bytes = 0;
+  globals->frameBudget.peakBytes = 0;
+  for (iStream = 0; iStream < globals->streamCount; iStream++)
+  {
+    GenericStream *gs = &(*globals->streams)[iStream];
+    gs->cueClusterOffset = -1;
+    if (gs->trackType == VideoMediaType)
+      gs->vid.drainTime = 0;
+    gs->frameQueue.stalls = 0;
+    setFrameQueueLimits(&gs->frameQueue, globals->queueCapacity, &globals->frameBudget);
+    if (gs->trackType == VideoMediaType && globals->bExportVideo && globals->clusterKeyStream < 0)
+      globals->clusterKeyStream = iStream;
+  }
 
   //start first pass in a two pass
   if (bTwoPass)
     _doFirstPass(globals);
 
 
-  while (!allStreamsDone)
+  if (initInterleaver(&interleaver, globals->streamCount) != 0)
   {
-    allStreamsDone = false;
+    err = mFulErr;
+    goto bail;
+  }
 
-    err = _compressEmptyStreams(globals);
+  while (!allStreamsDone && !globals->canceled)
+  {
+    err = _refillWaitingStreams(globals, &interleaver);
     if (err) goto bail;
 
-    allStreamsDone = _checkAllStreamsComplete(globals);
+    allStreamsDone = interleaver.waitingCount == 0 && interleaver.count == 0;
     if (allStreamsDone)
       break;
 
-    err = _getStreamWithMinTime(globals, &minTimeStream, &minTimeMs);
+    err = _getStreamWithMinTime(globals, &interleaver, &minTimeStream, &minTimeMs);
     if (err) goto bail;
 
     //if all frames that should be available find the earliest time:
     if (minTimeStream == NULL)  //some streams are waiting for compressed data
       continue;
     //write the stream with the earliest time
-    _startClusterIfNeeded(globals, &ebml, minTimeMs);
+    minFrame = getFrame(&minTimeStream->frameQueue);
+    _startClusterIfNeeded(globals, &ebml, minTimeMs, minFrame->size);
 
-    minFrame = minTimeStream->frameQueue.queue[0];
-
-    if (minTimeStream->trackType == VideoMediaType && (minFrame->frameType & KEY_FRAME) != 0)
+    if (!globals->bLiveMode && _needsCue(globals, minTimeStream, minFrame))
     {
         UInt64 tmpU = globals->clusterOffset - firstL1Offset;
-        _addCue(globals, tmpU , minFrame->timeMs, minTimeStream->source.trackID);
-    }  //end if VideoMediaType
+        err = _addCue(globals, tmpU , minFrame->timeMs, minTimeStream->source.trackID);
+        if (err) goto bail;
+        minTimeStream->cueClusterOffset = globals->clusterOffset;
+    }
     _writeBlock(globals, minTimeStream, &ebml);
+    _requeueStream(globals, &interleaver, minTimeStream - *globals->streams);
+    if (minTimeMs > lastTimeMs)
+      lastTimeMs = minTimeMs;
 
 
     globals->blocksInCluster ++;
 
-    Ebml_EndSubElement(&ebml, &globals->clusterStart);   //this writes cluster size multiple times, but works
-
     if (duration != 0.0)  //if duration is 0, can't show anything
     {
       double percentComplete = minTimeMs / 1000.0 / duration;
@@ -688,20 +842,75 @@ ComponentResult muxStreams(WebMExportGlobalsPtr globals, DataHandler data_h)
   }
 
   dbg_printf("[webm] done writing streams\n");
+  //a canceled export is finalized as a shorter, valid file
+  if (globals->canceled)
+    duration = lastTimeMs / 1000.0;
+  _endCluster(globals, &ebml);
   if (bTwoPass)
     _endSecondPass(globals);
 
-  //cues written at the end
-  _writeCues(globals, &ebml, &cuesLoc);
-  Ebml_EndSubElement(&ebml, &startSegment);
+  //Cues and the finalizing patches stay out of the media segments
+  if (globals->segments != NULL)
+  {
+    UInt64 endMs = duration * 1000.0;
+    if (lastTimeMs > endMs)
+      endMs = lastTimeMs;
+    Ebml_Flush(&ebml);
+    Ebml_EndSegments(globals->segments, endMs);
+  }
+
+  if (!globals->bLiveMode)
+  {
+    Boolean cuesWritten = false;
+
+    if (globals->bFastStart)
+    {
+      Ebml_StartPatch(&ebml, &cuesRegion);
+      _writeCues(globals, &ebml, &cuesLoc);
+      cuesWritten = Ebml_EndPatch(&ebml, &cuesRegion) == 0;
+      dbg_printf("[webm] %d cues %s the reserved %lu bytes\n", globals->cues.count,
+                 cuesWritten ? "fit in" : "did not fit in", cuesRegion.size);
+    }
 
-  //here I am rewriting the metaSeekInformation
-  _writeMetaSeekInformation(&ebml, &trackLoc, &cuesLoc, &segmentInfoLoc, &seekInfoLoc, firstL1Offset, false);
+    //otherwise cues written at the end, the reservation stays a Void
+    if (!cuesWritten)
+      _writeCues(globals, &ebml, &cuesLoc);
+
+    //Segment size, Info with the final duration and the SeekHead go out as one batch
+    if (lastTimeMs / 1000.0 > duration)
+      duration = lastTimeMs / 1000.0;
+    Ebml_DeferEndSubElement(&ebml, &startSegment);
+    err = _writeSegmentInformationRegion(globals, &ebml, &infoRegion, &segmentInfoLoc, duration);
+    if (err) goto bail;
+    err = _writeMetaSeekInformation(&ebml, &trackLoc, &cuesLoc, &segmentInfoLoc, &seekInfoLoc, firstL1Offset);
+    if (err) goto bail;
+    err = Ebml_ApplyPatches(&ebml);
+    if (err) goto bail;
+  }
 
   HUnlock((Handle) globals->streams);
 
-  err = _updateProgressBar(globals, 100.0);
+  if (globals->canceled)
+    err = userCanceledErr;
+  else
+    err = _updateProgressBar(globals, 1.0);
 bail:
+  _closeProgressBar(globals);
+  {
+    //push out whatever is still cached and surface any write failure
+    ComponentResult closeErr = Ebml_CloseGlobal(&ebml);
+    if (err == noErr)
+      err = closeErr;
+  }
+  freeInterleaver(&interleaver);
+  for (iStream = 0; iStream < globals->streamCount; iStream++)
+    dbg_printf("[WebM] stream %lu producer stalls %llu\n", iStream,
+               (*globals->streams)[iStream].frameQueue.stalls);
+  dbg_printf("[WebM] peak queued bytes %llu\n", globals->frameBudget.peakBytes);
+  dbg_printf("[WebM] payload pool hits %llu misses %llu oversize %llu borrowed %llu cached %llu\n",
+             globals->payloadPool.hits, globals->payloadPool.misses, globals->payloadPool.oversize,
+             globals->payloadPool.borrowed, globals->payloadPool.cachedBytes);
+  memAccountDump("WebM export");
   dbg_printf("[WebM] <   [%08lx] :: muxStreams() = %ld\n", (UInt32) globals, err);
   return err;
 }
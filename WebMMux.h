@@ -10,7 +10,7 @@
 #ifndef _MKVMUX_H
 #define _MKVMUX_H
 
-ComponentResult muxStreams(WebMExportGlobalsPtr globals, DataHandler data_h);
+ComponentResult muxStreams(WebMExportGlobalsPtr globals, EbmlSink *sink);
 
 
 #endif
@@ -10,6 +10,10 @@
 #include <QuickTime/QuickTime.h>
 #include "WebMExportStructs.h"
 #include "WebMVideoStream.h"
+#include "WebMExportVersions.h"
+
+//VP8 lag-in-frames tops out at 25, an alt-ref adds one
+#define kMaxDrainLagFrames 32
 
 OSStatus EnableMultiPassWithTemporaryFile(ICMCompressionSessionOptionsRef inCompressionSessionOptions,
                                           ICMMultiPassStorageRef *outMultiPassStorage)
@@ -156,6 +160,21 @@ ComponentResult openDecompressionSession(GenericStreamPtr vs)
 }
 
 
+static void _releaseEncodedFrame(void *owner)
+{
+  ICMEncodedFrameRelease((ICMEncodedFrameRef) owner);
+}
+
+//the encoded frame stays retained until the muxer has written every slice of it
+static WebMPayload *_borrowEncodedFrame(GenericStreamPtr vs, ICMEncodedFrameRef ef)
+{
+  WebMPayload *payload = borrowPayload(vs->frameQueue.pool, (void *) ICMEncodedFrameGetDataPtr(ef),
+                                       ICMEncodedFrameGetDataSize(ef), _releaseEncodedFrame, ef);
+  if (payload != NULL)
+    ICMEncodedFrameRetain(ef);
+  return payload;
+}
+
 static OSStatus
 _frame_compressed_callback(void *efRefCon, ICMCompressionSessionRef session,
                            OSStatus err, ICMEncodedFrameRef ef, void *reserved)
@@ -212,11 +231,13 @@ _frame_compressed_callback(void *efRefCon, ICMCompressionSessionRef session,
   {
     if (frame_type == kICMFrameType_I)
       frameFlags += KEY_FRAME;
-    //create a buffer with frame data
-    void * buf = malloc(enc_size);
-    memcpy(buf, ICMEncodedFrameGetDataPtr(ef), enc_size);
+    //the queue borrows the frame data, no copy
+    WebMPayload *payload = _borrowEncodedFrame(vs, ef);
+    if (payload == NULL)
+      return mFulErr;
 
-    addFrameToQueue(&vs->frameQueue, buf, enc_size,  timeMs, frameFlags, decodeNum -1);
+    if (addFrameToQueue(&vs->frameQueue, payload, 0, enc_size,  timeMs, frameFlags, decodeNum -1) != 0)
+      return mFulErr;
   }
   else
   {
@@ -225,18 +246,27 @@ _frame_compressed_callback(void *efRefCon, ICMCompressionSessionRef session,
     const unsigned char * cBuf = ICMEncodedFrameGetDataPtr(ef);
     UInt32 altrefPortion= *((UInt32*)cBuf);
     dbg_printf("[WebM]Size Of altref data in frame %lu at time %lu\n", altrefPortion, decodeTimeMs);
-    void * altrefBuf = malloc(altrefPortion);
-    memcpy(altrefBuf, &cBuf[4], altrefPortion);
+    if (enc_size < 4 || altrefPortion > enc_size - 4)
+      return paramErr;
+
+    //both frames are slices of the one borrowed buffer
+    WebMPayload *payload = _borrowEncodedFrame(vs, ef);
+    if (payload == NULL)
+      return mFulErr;
+    retainPayload(payload);
     frameFlags += ALT_REF_FRAME; // currently using the unknown to indicat alt-ref
-    addFrameToQueue(&vs->frameQueue, altrefBuf, altrefPortion,  decodeTimeMs, frameFlags, decodeNum -1);
+    if (addFrameToQueue(&vs->frameQueue, payload, 4, altrefPortion,  decodeTimeMs, frameFlags, decodeNum -1) != 0)
+    {
+      releasePayload(payload);  //the reference meant for the inter frame
+      return mFulErr;
+    }
 
     //also write the following interframe
     UInt32 framePortion = enc_size - altrefPortion -4;
     dbg_printf("[WebM]Size Of inter frame %lu at time %lu\n", framePortion, timeMs);
     frameFlags = VIDEO_FRAME;
-    void * frameBuf = malloc(altrefPortion);
-    memcpy(frameBuf, &cBuf[altrefPortion+4], altrefPortion);
-    addFrameToQueue(&vs->frameQueue, frameBuf, framePortion,  timeMs, frameFlags, decodeNum -1);
+    if (addFrameToQueue(&vs->frameQueue, payload, altrefPortion + 4, framePortion,  timeMs, frameFlags, decodeNum -1) != 0)
+      return mFulErr;
   }
 
   vs->vid.lastTimeMs = timeMs;
@@ -414,6 +444,53 @@ static void initFrameTimeRecord(GenericStreamPtr vs, ICMFrameTimeRecord *frameTi
   dbg_printf("[webM] init Frame Time %lld scale = %ld\n", frameTimeRecord->value, frameTimeRecord->scale);
 }
 
+//At the end of the source the encoder still holds its lag-in-frames.  They
+//are completed a frame duration at a time while the queue has room, so the
+//end of a long lag does not land in memory all at once.
+static ComponentResult _drainCompressionSession(WebMExportGlobalsPtr globals, GenericStreamPtr vs)
+{
+  ComponentResult err = noErr;
+  TimeValue64 endTime = vs->source.time;
+  TimeValue64 step = 1;
+
+  if (globals->framerate > 0)
+    step = vs->source.timeScale / globals->framerate;
+  if (step < 1)
+    step = 1;
+
+  if (vs->vid.drainTime == 0)
+  {
+    //nothing before the last emitted frame, nor more than the deepest lag back, is held
+    vs->vid.drainTime = (TimeValue64) vs->vid.lastTimeMs * vs->source.timeScale / 1000;
+    if (endTime > kMaxDrainLagFrames * step && vs->vid.drainTime < endTime - kMaxDrainLagFrames * step)
+      vs->vid.drainTime = endTime - kMaxDrainLagFrames * step;
+  }
+
+  while (!vs->complete && frameQueueHasRoom(&vs->frameQueue))
+  {
+    vs->vid.drainTime += step;
+    if (vs->vid.drainTime >= endTime)
+    {
+      dbg_printf("Completing Frames\n");
+      err = ICMCompressionSessionCompleteFrames(vs->vid.compressionSession,
+                                                true,  //complete all frames
+                                                0, //ignored when complete all frames true
+                                                0);  //also ignored
+      vs->complete = true;
+    }
+    else
+      err = ICMCompressionSessionCompleteFrames(vs->vid.compressionSession, false,
+                                                vs->vid.drainTime, vs->source.timeScale);
+    if (err)
+      return err;
+  }
+
+  if (!vs->complete)
+    vs->frameQueue.stalls++;
+
+  return err;
+}
+
 //buffer is null when there are no more frames
 ComponentResult compressNextFrame(WebMExportGlobalsPtr globals, GenericStreamPtr vs)
 {
@@ -467,14 +544,7 @@ ComponentResult compressNextFrame(WebMExportGlobalsPtr globals, GenericStreamPtr
                                              &frameTimeRecord, vs);
   }
   else
-  {
-    dbg_printf("Completing Frames\n");
-    ICMCompressionSessionCompleteFrames(vs->vid.compressionSession,
-                                        true,  //complete all frames
-                                        0, //ignored when complete all frames true
-                                        0);  //also ignored
-    vs->complete = true;
-  }
+    err = _drainCompressionSession(globals, vs);
   //increment next source time
   double framerate = globals->framerate;
   if (framerate == 0)
@@ -489,6 +559,69 @@ ComponentResult compressNextFrame(WebMExportGlobalsPtr globals, GenericStreamPtr
   return err;
 }
 
+//The source description is only known after fetching a sample, the first one
+//is read here and again by the first copyNextFrame.
+Boolean canPassthroughVideo(GenericStreamPtr vs)
+{
+  ComponentResult err;
+  ImageDescriptionHandle idh;
+
+  initMovieGetParams(&vs->source);
+  err = InvokeMovieExportGetDataUPP(vs->source.refCon, &vs->source.params,
+                                    vs->source.dataProc);
+  if (err != noErr || vs->source.params.desc == NULL)
+    return false;
+
+  idh = (ImageDescriptionHandle) vs->source.params.desc;
+  dbg_printf("[webm] video source is '%4.4s'\n", (char *) &(*idh)->cType);
+  return (*idh)->cType == kVP8CodecFormatType;
+}
+
+//passthrough counterpart of compressNextFrame, the source sample goes into
+//the queue as it is and the sync flag decides if it is a keyframe
+ComponentResult copyNextFrame(WebMExportGlobalsPtr globals, GenericStreamPtr vs)
+{
+  ComponentResult err = noErr;
+  MovieExportGetDataParams *params = &vs->source.params;
+  UInt16 frameFlags = VIDEO_FRAME;
+  UInt64 timeMs;
+  WebMPayload *payload;
+
+  initMovieGetParams(&vs->source);
+  err = InvokeMovieExportGetDataUPP(vs->source.refCon, params, vs->source.dataProc);
+
+  if (err == eofErr || (err == noErr && params->actualSampleCount == 0))
+  {
+    vs->source.eos = true;
+    vs->complete = true;
+    return noErr;
+  }
+
+  if (err != noErr)
+    return err;
+
+  dbg_printDataParams(&vs->source);
+
+  if (globals->framerate == 0 && params->durationPerSample != 0)
+    globals->framerate = (1.0 * params->sourceTimeScale) / (1.0 * params->durationPerSample);
+
+  if ((params->sampleFlags & mediaSampleNotSync) == 0)
+    frameFlags += KEY_FRAME;
+
+  payload = allocPayload(vs->frameQueue.pool, params->dataSize);
+  if (payload == NULL)
+    return mFulErr;
+  memcpy(payload->data, params->dataPtr, params->dataSize);
+
+  timeMs = (SInt64) params->actualTime * 1000 / vs->source.timeScale;
+  vs->framesIn += 1;
+  if (addFrameToQueue(&vs->frameQueue, payload, 0, params->dataSize, timeMs, frameFlags, vs->framesIn - 1) != 0)
+    return mFulErr;
+
+  vs->source.time = params->actualTime + params->durationPerSample * params->actualSampleCount;
+  return noErr;
+}
+
 ComponentResult initVideoStream(GenericStreamPtr vs)
 {
   memset(vs, 0, sizeof(GenericStreamPtr));
@@ -14,6 +14,9 @@ ComponentResult openDecompressionSession(GenericStreamPtr si);
 ComponentResult openCompressionSession(WebMExportGlobalsPtr globals, GenericStreamPtr si);
 
 ComponentResult compressNextFrame(WebMExportGlobalsPtr globals, GenericStreamPtr si);
+//VP8 sources are muxed without decoding and encoding again
+Boolean canPassthroughVideo(GenericStreamPtr vs);
+ComponentResult copyNextFrame(WebMExportGlobalsPtr globals, GenericStreamPtr vs);
 ComponentResult initVideoStream(GenericStreamPtr vs);
 ComponentResult startPass(GenericStreamPtr vs,int pass);
 ComponentResult endPass(GenericStreamPtr vs);
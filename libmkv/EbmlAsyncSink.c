@@ -0,0 +1,293 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#include "EbmlAsyncSink.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+static void *_writerThread(void *arg)
+{
+    EbmlAsyncSink *async = (EbmlAsyncSink *)arg;
+    EbmlSink *inner = async->inner;
+    int attached;
+    int err = 0;
+
+    if (inner->attachThread != NULL)
+        err = inner->attachThread(inner->refCon);
+
+    //without the inner sink's per thread state nothing may be written, the
+    //queued buffers are still drained so the caller never blocks and gets
+    //the attach error back
+    attached = err == 0;
+
+    pthread_mutex_lock(&async->mutex);
+
+    if (err != 0 && async->err == 0)
+        async->err = err;
+
+    for (;;)
+    {
+        while (async->pending < 0 && !async->flushPending && !async->stop)
+            pthread_cond_wait(&async->cond, &async->mutex);
+
+        if (async->pending < 0 && !async->flushPending)
+            break;  //stop requested and nothing left to write
+
+        if (async->pending >= 0)
+        {
+            EbmlAsyncBuffer *buffer = &async->buffers[async->pending];
+
+            //the caller never touches a pending buffer, write it unlocked
+            pthread_mutex_unlock(&async->mutex);
+
+            err = 0;
+
+            if (attached && buffer->length > 0)
+            {
+                if (buffer->offset == async->innerEnd)
+                    err = inner->write(inner->refCon, buffer->data, buffer->length);
+                else
+                    err = inner->writeAt(inner->refCon, buffer->offset, buffer->data, buffer->length);
+            }
+
+            pthread_mutex_lock(&async->mutex);
+
+            if (attached && err == 0 && buffer->offset + buffer->length > async->innerEnd)
+                async->innerEnd = buffer->offset + buffer->length;
+
+            if (err != 0 && async->err == 0)
+                async->err = err;
+
+            async->pending = -1;
+        }
+        else
+        {
+            err = 0;
+
+            if (attached)
+            {
+                pthread_mutex_unlock(&async->mutex);
+                err = inner->flush(inner->refCon);
+                pthread_mutex_lock(&async->mutex);
+            }
+
+            if (err != 0 && async->err == 0)
+                async->err = err;
+
+            async->flushPending = 0;
+        }
+
+        pthread_cond_broadcast(&async->cond);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+
+    if (attached && inner->detachThread != NULL)
+        inner->detachThread(inner->refCon);
+
+    return NULL;
+}
+
+//waits for the thread to finish the queued buffer, called with the lock held
+static void _waitIdle(EbmlAsyncSink *async)
+{
+    while (async->pending >= 0 || async->flushPending)
+        pthread_cond_wait(&async->cond, &async->mutex);
+}
+
+//queues the active buffer and starts filling the other one at offset
+static int _submit(EbmlAsyncSink *async, unsigned long long nextOffset)
+{
+    EbmlAsyncBuffer *next;
+    int err;
+
+    pthread_mutex_lock(&async->mutex);
+    _waitIdle(async);
+    async->pending = async->active;
+    async->active = 1 - async->active;
+    err = async->err;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    next = &async->buffers[async->active];
+    next->length = 0;
+    next->offset = nextOffset;
+    return err;
+}
+
+static int _asyncWrite(void *refCon, const void *buffer_in, unsigned long len)
+{
+    EbmlAsyncSink *async = (EbmlAsyncSink *)refCon;
+    const unsigned char *p = (const unsigned char *)buffer_in;
+    int err = 0;
+
+    while (len > 0)
+    {
+        EbmlAsyncBuffer *buffer = &async->buffers[async->active];
+        unsigned long n = async->bufferSize - buffer->length;
+
+        if (n > len)
+            n = len;
+
+        memcpy(buffer->data + buffer->length, p, n);
+        buffer->length += n;
+        async->end += n;
+        p += n;
+        len -= n;
+
+        if (buffer->length == async->bufferSize)
+            err = _submit(async, async->end);
+    }
+
+    return err;
+}
+
+static int _asyncWriteAt(void *refCon, unsigned long long pos, const void *buffer_in, unsigned long len)
+{
+    EbmlAsyncSink *async = (EbmlAsyncSink *)refCon;
+    EbmlAsyncBuffer *buffer = &async->buffers[async->active];
+    const unsigned char *p = (const unsigned char *)buffer_in;
+    int err = 0;
+
+    if (pos == async->end)
+        return _asyncWrite(refCon, buffer_in, len);
+
+    //still in the buffer being filled, patch it in memory
+    if (pos >= buffer->offset && pos + len <= buffer->offset + buffer->length)
+    {
+        memcpy(buffer->data + (pos - buffer->offset), buffer_in, len);
+        return 0;
+    }
+
+    //everything before the patch has to reach the inner sink first
+    if (buffer->length > 0)
+        err = _submit(async, async->end);
+
+    while (len > 0 && err == 0)
+    {
+        unsigned long n = len < async->bufferSize ? len : async->bufferSize;
+
+        buffer = &async->buffers[async->active];
+        buffer->offset = pos;
+        memcpy(buffer->data, p, n);
+        buffer->length = n;
+        err = _submit(async, async->end);
+
+        p += n;
+        pos += n;
+        len -= n;
+    }
+
+    if (pos > async->end)
+    {
+        async->end = pos;
+        async->buffers[async->active].offset = pos;
+    }
+
+    return err;
+}
+
+static unsigned long long _asyncTell(void *refCon)
+{
+    EbmlAsyncSink *async = (EbmlAsyncSink *)refCon;
+    return async->end;
+}
+
+static int _asyncFlush(void *refCon)
+{
+    EbmlAsyncSink *async = (EbmlAsyncSink *)refCon;
+    int err;
+
+    if (async->buffers[async->active].length > 0)
+        _submit(async, async->end);
+
+    pthread_mutex_lock(&async->mutex);
+    _waitIdle(async);
+    async->flushPending = 1;
+    pthread_cond_broadcast(&async->cond);
+    _waitIdle(async);
+    err = async->err;
+    pthread_mutex_unlock(&async->mutex);
+    return err;
+}
+
+int Ebml_InitAsyncSink(EbmlSink *sink, EbmlAsyncSink *async, EbmlSink *inner, unsigned long bufferSize)
+{
+    int i;
+
+    async->inner = inner;
+    async->bufferSize = bufferSize ? bufferSize : EBML_ASYNC_BUFFER_SIZE;
+    async->active = 0;
+    async->pending = -1;
+    async->flushPending = 0;
+    async->stop = 0;
+    async->err = 0;
+    async->end = inner->tell(inner->refCon);
+    async->innerEnd = async->end;
+
+    for (i = 0; i < 2; i++)
+    {
+        async->buffers[i].data = malloc(async->bufferSize);
+        async->buffers[i].length = 0;
+        async->buffers[i].offset = async->end;
+    }
+
+    if (async->buffers[0].data == NULL || async->buffers[1].data == NULL)
+    {
+        free(async->buffers[0].data);
+        free(async->buffers[1].data);
+        return ENOMEM;
+    }
+
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    if (pthread_create(&async->thread, NULL, _writerThread, async) != 0)
+    {
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->mutex);
+        free(async->buffers[0].data);
+        free(async->buffers[1].data);
+        return EAGAIN;
+    }
+
+    sink->write = _asyncWrite;
+    sink->writeAt = _asyncWriteAt;
+    sink->tell = _asyncTell;
+    sink->flush = _asyncFlush;
+    sink->attachThread = NULL;
+    sink->detachThread = NULL;
+    sink->refCon = async;
+    return 0;
+}
+
+int Ebml_CloseAsyncSink(EbmlAsyncSink *async)
+{
+    int err;
+
+    if (async->buffers[async->active].length > 0)
+        _submit(async, async->end);
+
+    pthread_mutex_lock(&async->mutex);
+    async->stop = 1;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    pthread_join(async->thread, NULL);
+
+    err = async->err;
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    free(async->buffers[0].data);
+    free(async->buffers[1].data);
+    async->buffers[0].data = NULL;
+    async->buffers[1].data = NULL;
+    return err;
+}
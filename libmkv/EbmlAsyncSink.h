@@ -0,0 +1,53 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef EBMLASYNCSINK_HPP
+#define EBMLASYNCSINK_HPP
+
+#include <pthread.h>
+#include "EbmlSink.h"
+
+#define EBML_ASYNC_BUFFER_SIZE (1024 * 1024)
+
+typedef struct
+{
+    unsigned char *data;
+    unsigned long length;
+    unsigned long long offset;  //output position of data[0]
+} EbmlAsyncBuffer;
+
+//Sink that hands its output to a background thread.  The caller fills one
+//buffer while the thread writes the other to the inner sink, so at most two
+//buffers are in memory.  Every call on the inner sink, patches included, is
+//made from the background thread.  Errors from the inner sink are sticky and
+//returned by the next write, flush or Ebml_CloseAsyncSink.
+typedef struct
+{
+    EbmlSink *inner;
+    EbmlAsyncBuffer buffers[2];
+    unsigned long bufferSize;
+    int active;                 //buffer filled by the caller
+    int pending;                //buffer queued for the thread, -1 for none
+    int flushPending;           //inner flush queued for the thread
+    int stop;
+    int err;
+    unsigned long long end;     //end of the output including buffered bytes
+    unsigned long long innerEnd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} EbmlAsyncSink;
+
+//bufferSize of 0 uses EBML_ASYNC_BUFFER_SIZE
+int Ebml_InitAsyncSink(EbmlSink *sink, EbmlAsyncSink *async, EbmlSink *inner, unsigned long bufferSize);
+//writes everything still buffered, stops the thread and returns the first error
+int Ebml_CloseAsyncSink(EbmlAsyncSink *async);
+
+
+#endif
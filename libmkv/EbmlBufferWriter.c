@@ -1,60 +1,169 @@
 //#include <strmif.h>
 #include "EbmlBufferWriter.h"
-#include "EbmlWriter.h"
 //#include <cassert>
 //#include <limits>
 //#include <malloc.h>  //_alloca
 #include <stdlib.h>
-#include <wchar.h>
+#include <errno.h>
 #include <string.h>
 
-void Ebml_Write(EbmlGlobal *glob, const void *buffer_in, unsigned long len)
+static int _reserve(EbmlBufferSink *buffer, unsigned long long end)
 {
-    unsigned char *src = glob->buf;
-    src += glob->offset;
-    memcpy(src, buffer_in, len);
-    glob->offset += len;
+    unsigned long needed = (unsigned long)((end + buffer->chunkSize - 1) / buffer->chunkSize);
+
+    if (needed > buffer->chunkCapacity)
+    {
+        //only the chunk table is reallocated, chunk contents never move
+        unsigned long capacity = buffer->chunkCapacity ? buffer->chunkCapacity : 8;
+
+        while (capacity < needed)
+            capacity *= 2;
+
+        unsigned char **chunks = realloc(buffer->chunks, capacity * sizeof(unsigned char *));
+
+        if (chunks == NULL)
+            return ENOMEM;
+
+        buffer->chunks = chunks;
+        buffer->chunkCapacity = capacity;
+    }
+
+    while (buffer->chunkCount < needed)
+    {
+        unsigned char *chunk = malloc(buffer->chunkSize);
+
+        if (chunk == NULL)
+            return ENOMEM;
+
+        buffer->chunks[buffer->chunkCount++] = chunk;
+    }
+
+    return 0;
 }
 
-static void _Serialize(EbmlGlobal *glob, const unsigned char *p, const unsigned char *q)
+static void _copyIn(EbmlBufferSink *buffer, unsigned long long pos, const unsigned char *src, unsigned long len)
 {
-    while (q != p)
+    while (len > 0)
     {
-        --q;
+        unsigned long index = (unsigned long)(pos / buffer->chunkSize);
+        unsigned long chunkOffset = (unsigned long)(pos % buffer->chunkSize);
+        unsigned long n = buffer->chunkSize - chunkOffset;
+
+        if (n > len)
+            n = len;
 
-        unsigned long cbWritten;
-        memcpy(&(glob->buf[glob->offset]), q, 1);
-        glob->offset ++;
+        if (src != NULL)
+        {
+            memcpy(buffer->chunks[index] + chunkOffset, src, n);
+            src += n;
+        }
+        else
+            memset(buffer->chunks[index] + chunkOffset, 0, n);
+
+        pos += n;
+        len -= n;
     }
 }
 
-void Ebml_Serialize(EbmlGlobal *glob, const void *buffer_in, unsigned long len)
+static int _bufferWriteAt(void *refCon, unsigned long long pos, const void *buffer_in, unsigned long len)
+{
+    EbmlBufferSink *buffer = (EbmlBufferSink *)refCon;
+    unsigned long long end = pos + len;
+    int err;
+
+    if (buffer->maxSize != 0 && end > buffer->maxSize)
+        return ENOSPC;
+
+    err = _reserve(buffer, end);
+
+    if (err != 0)
+        return err;
+
+    //a write past the end leaves zeros in the gap
+    if (pos > buffer->size)
+        _copyIn(buffer, buffer->size, NULL, (unsigned long)(pos - buffer->size));
+
+    _copyIn(buffer, pos, (const unsigned char *)buffer_in, len);
+
+    if (end > buffer->size)
+        buffer->size = end;
+
+    return 0;
+}
+
+static int _bufferWrite(void *refCon, const void *buffer_in, unsigned long len)
 {
-    //assert(buf);
+    EbmlBufferSink *buffer = (EbmlBufferSink *)refCon;
+    return _bufferWriteAt(refCon, buffer->size, buffer_in, len);
+}
 
-    const unsigned char *const p = (const unsigned char *)(buffer_in);
-    const unsigned char *const q = p + len;
+static unsigned long long _bufferTell(void *refCon)
+{
+    EbmlBufferSink *buffer = (EbmlBufferSink *)refCon;
+    return buffer->size;
+}
+
+static int _bufferFlush(void *refCon)
+{
+    return 0;
+}
+
+int Ebml_InitBufferSink(EbmlSink *sink, EbmlBufferSink *buffer, unsigned long chunkSize)
+{
+    buffer->chunks = NULL;
+    buffer->chunkCount = 0;
+    buffer->chunkCapacity = 0;
+    buffer->chunkSize = chunkSize ? chunkSize : EBML_BUFFER_CHUNK_SIZE;
+    buffer->size = 0;
+    buffer->maxSize = 0;
 
-    _Serialize(glob, p, q);
+    sink->write = _bufferWrite;
+    sink->writeAt = _bufferWriteAt;
+    sink->tell = _bufferTell;
+    sink->flush = _bufferFlush;
+    sink->attachThread = NULL;
+    sink->detachThread = NULL;
+    sink->refCon = buffer;
+    return 0;
 }
 
+void Ebml_ResetBufferSink(EbmlBufferSink *buffer)
+{
+    buffer->size = 0;
+}
 
-void Ebml_StartSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id)
+void Ebml_FreeBufferSink(EbmlBufferSink *buffer)
 {
-    Ebml_WriteID(glob, class_id);
-    ebmlLoc->offset = glob->offset;
-    //todo this is always taking 8 bytes, this may need later optimization
-    unsigned long long unknownLen =  0x01FFFFFFFFFFFFFFLLU;
-    Ebml_Serialize(glob, (void *)&unknownLen, 8); //this is a key that says lenght unknown
+    unsigned long i;
+
+    for (i = 0; i < buffer->chunkCount; i++)
+        free(buffer->chunks[i]);
+
+    free(buffer->chunks);
+    buffer->chunks = NULL;
+    buffer->chunkCount = 0;
+    buffer->chunkCapacity = 0;
+    buffer->size = 0;
 }
 
-void Ebml_EndSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc)
+int Ebml_BufferIOVecCount(EbmlBufferSink *buffer)
 {
-    unsigned long long size = glob->offset - ebmlLoc->offset - 8;
-    unsigned long long curOffset = glob->offset;
-    glob->offset = ebmlLoc->offset;
-    size |=  0x0100000000000000LLU;
-    Ebml_Serialize(glob, &size, 8);
-    glob->offset = curOffset;
+    return (int)((buffer->size + buffer->chunkSize - 1) / buffer->chunkSize);
 }
 
+int Ebml_BufferIOVec(EbmlBufferSink *buffer, struct iovec *iov, int maxIov)
+{
+    unsigned long long remaining = buffer->size;
+    int i;
+
+    for (i = 0; i < maxIov && remaining > 0; i++)
+    {
+        unsigned long n = remaining < buffer->chunkSize ? (unsigned long)remaining : buffer->chunkSize;
+
+        iov[i].iov_base = buffer->chunks[i];
+        iov[i].iov_len = n;
+        remaining -= n;
+    }
+
+    return i;
+}
@@ -1,21 +1,34 @@
 #ifndef EBMLBUFFERWRITER_HPP
 #define EBMLBUFFERWRITER_HPP
 
-typedef struct
-{
-    unsigned long long offset;
-} EbmlLoc;
+#include <sys/uio.h>
+#include "EbmlSink.h"
+
+#define EBML_BUFFER_CHUNK_SIZE (1024 * 1024)
 
+//In memory sink built from a chain of equally sized chunks.  Growing never
+//moves bytes already written and sizes can be patched at any position,
+//including across a chunk boundary.
 typedef struct
 {
-    unsigned char *buf;
-    unsigned int length;
-    unsigned int offset;
-} EbmlGlobal;
+    unsigned char **chunks;
+    unsigned long chunkCount;
+    unsigned long chunkCapacity;  //slots in chunks
+    unsigned long chunkSize;
+    unsigned long long size;      //bytes written so far
+    unsigned long long maxSize;   //0 for no limit
+} EbmlBufferSink;
 
+//chunkSize of 0 uses EBML_BUFFER_CHUNK_SIZE
+int Ebml_InitBufferSink(EbmlSink *sink, EbmlBufferSink *buffer, unsigned long chunkSize);
+//drops the contents but keeps the chunks for reuse
+void Ebml_ResetBufferSink(EbmlBufferSink *buffer);
+void Ebml_FreeBufferSink(EbmlBufferSink *buffer);
 
-void Ebml_StartSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id);
-void Ebml_EndSubElement(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
+//number of iovec entries needed to describe the contents
+int Ebml_BufferIOVecCount(EbmlBufferSink *buffer);
+//fills up to maxIov entries in output order, returns the number filled
+int Ebml_BufferIOVec(EbmlBufferSink *buffer, struct iovec *iov, int maxIov);
 
 
 #endif
@@ -0,0 +1,303 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#include "EbmlCRC.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EBML_CRC_PCLMUL 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define EBML_CRC_ARMV8 1
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+//reflected polynomial 0x04C11DB7
+#define kCRC32Polynomial 0xEDB88320U
+
+//all implementations work on the inverted crc register
+typedef uint32_t (*CRC32Func)(uint32_t crc, const unsigned char *buf, unsigned long len);
+
+static uint32_t sCRCTable[8][256];
+static CRC32Func sCRC32 = NULL;
+static const char *sCRC32Name = "slice-by-8";
+static pthread_once_t sCRCOnce = PTHREAD_ONCE_INIT;
+
+static void _buildTables(void)
+{
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (kCRC32Polynomial & (0U - (crc & 1)));
+
+        sCRCTable[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++)
+    {
+        for (j = 1; j < 8; j++)
+            sCRCTable[j][i] = (sCRCTable[j - 1][i] >> 8) ^ sCRCTable[0][sCRCTable[j - 1][i] & 0xFF];
+    }
+}
+
+static uint32_t _crcSliceBy8(uint32_t crc, const unsigned char *buf, unsigned long len)
+{
+    while (len >= 8)
+    {
+        //assemble little endian so the tables work on any host
+        uint32_t lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                             (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+        uint32_t hi = (uint32_t)buf[4] | (uint32_t)buf[5] << 8 |
+                      (uint32_t)buf[6] << 16 | (uint32_t)buf[7] << 24;
+
+        crc = sCRCTable[7][lo & 0xFF] ^ sCRCTable[6][(lo >> 8) & 0xFF] ^
+              sCRCTable[5][(lo >> 16) & 0xFF] ^ sCRCTable[4][lo >> 24] ^
+              sCRCTable[3][hi & 0xFF] ^ sCRCTable[2][(hi >> 8) & 0xFF] ^
+              sCRCTable[1][(hi >> 16) & 0xFF] ^ sCRCTable[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = (crc >> 8) ^ sCRCTable[0][(crc ^ *buf++) & 0xFF];
+
+    return crc;
+}
+
+#if defined(EBML_CRC_PCLMUL)
+//Folds 64 bytes at a time with carry-less multiplies, then Barrett reduces
+//to 32 bits ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ",
+//Intel).  len must be at least 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t _crcFold(uint32_t crc, const unsigned char *buf, unsigned long len)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    //four independent folds per iteration
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    //fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    //128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    //Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t _crcPCLMUL(uint32_t crc, const unsigned char *buf, unsigned long len)
+{
+    if (len >= 64)
+    {
+        unsigned long folded = len & ~15UL;
+        crc = _crcFold(crc, buf, folded);
+        buf += folded;
+        len -= folded;
+    }
+
+    return _crcSliceBy8(crc, buf, len);
+}
+
+static int _hasPCLMUL(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0;
+}
+#endif
+
+#if defined(EBML_CRC_ARMV8)
+__attribute__((target("+crc")))
+static uint32_t _crcARMv8(uint32_t crc, const unsigned char *buf, unsigned long len)
+{
+    while (len > 0 && ((uintptr_t)buf & 7) != 0)
+    {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+    while (len >= 32)
+    {
+        uint64_t v[4];
+        memcpy(v, buf, 32);
+        crc = __crc32d(crc, v[0]);
+        crc = __crc32d(crc, v[1]);
+        crc = __crc32d(crc, v[2]);
+        crc = __crc32d(crc, v[3]);
+        buf += 32;
+        len -= 32;
+    }
+
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        crc = __crc32d(crc, v);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len > 0)
+    {
+        crc = __crc32b(crc, *buf++);
+        len--;
+    }
+
+    return crc;
+}
+
+static int _hasARMv8CRC(void)
+{
+#if defined(__APPLE__)
+    return 1;  //every arm64 Mac has the crc32 instructions
+#elif defined(__linux__) && defined(HWCAP_CRC32)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+    return 0;
+#endif
+}
+#endif
+
+static void _initCRC(void)
+{
+    _buildTables();
+    sCRC32 = _crcSliceBy8;
+
+#if defined(EBML_CRC_PCLMUL)
+    if (_hasPCLMUL())
+    {
+        sCRC32 = _crcPCLMUL;
+        sCRC32Name = "pclmul";
+    }
+#endif
+
+#if defined(EBML_CRC_ARMV8)
+    if (_hasARMv8CRC())
+    {
+        sCRC32 = _crcARMv8;
+        sCRC32Name = "armv8-crc32";
+    }
+#endif
+}
+
+unsigned int Ebml_CRC32(unsigned int crc, const void *data, unsigned long len)
+{
+    pthread_once(&sCRCOnce, _initCRC);
+    return ~sCRC32(~(uint32_t)crc, (const unsigned char *)data, len);
+}
+
+unsigned int Ebml_CRC32SliceBy8(unsigned int crc, const void *data, unsigned long len)
+{
+    pthread_once(&sCRCOnce, _initCRC);
+    return ~_crcSliceBy8(~(uint32_t)crc, (const unsigned char *)data, len);
+}
+
+const char *Ebml_CRC32Implementation(void)
+{
+    pthread_once(&sCRCOnce, _initCRC);
+    return sCRC32Name;
+}
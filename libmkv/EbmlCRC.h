@@ -0,0 +1,25 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef EBMLCRC_HPP
+#define EBMLCRC_HPP
+
+//CRC-32 (IEEE 802.3, as used by the EBML CRC-32 element).  crc is the value
+//returned for the preceding data, 0 to start.  The fastest implementation
+//the cpu supports (PCLMUL, ARMv8 CRC32 or slice-by-8) is picked on first use.
+unsigned int Ebml_CRC32(unsigned int crc, const void *data, unsigned long len);
+
+//portable version, always available
+unsigned int Ebml_CRC32SliceBy8(unsigned int crc, const void *data, unsigned long len);
+
+//name of the implementation Ebml_CRC32 uses
+const char *Ebml_CRC32Implementation(void);
+
+
+#endif
@@ -0,0 +1,98 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef EBMLENCODE_HPP
+#define EBMLENCODE_HPP
+
+//Encoding kernels for the ebml primitives.  Each one stores a full 8 bytes
+//at out (only the leading bytes are meaningful) and returns how many bytes
+//the encoding takes, so callers can pack several fields back to back and
+//hand the result to Ebml_Write once.  out must have 8 writable bytes.
+
+#include <string.h>
+
+//largest value a VINT can carry, all ones is reserved for "unknown"
+#define EBML_VINT_MAX 0x00FFFFFFFFFFFFFELLU
+
+static inline int Ebml_BitWidth(unsigned long long val)
+{
+#if defined(__GNUC__)
+    return val ? 64 - __builtin_clzll(val) : 0;
+#else
+    int bits = 0;
+
+    while (val)
+    {
+        bits++;
+        val >>= 1;
+    }
+
+    return bits;
+#endif
+}
+
+//stores val big endian with its most significant byte at out[0]
+static inline void Ebml_StoreBE64(unsigned char *out, unsigned long long val)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    val = __builtin_bswap64(val);
+    memcpy(out, &val, 8);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(out, &val, 8);
+#else
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        out[i] = (unsigned char)val;
+        val >>= 8;
+    }
+#endif
+}
+
+//bytes needed for an unsigned integer, at least one
+static inline int Ebml_UnsignedWidth(unsigned long long val)
+{
+    return (Ebml_BitWidth(val | 1) + 7) >> 3;
+}
+
+//bytes needed for val as a VINT, val must not exceed EBML_VINT_MAX
+static inline int Ebml_VIntWidth(unsigned long long val)
+{
+    return (Ebml_BitWidth(val + 1) + 6) / 7;
+}
+
+static inline int Ebml_EncodeUnsigned(unsigned char *out, unsigned long long val)
+{
+    int width = Ebml_UnsignedWidth(val);
+    Ebml_StoreBE64(out, val << (64 - 8 * width));
+    return width;
+}
+
+//ids already carry their length marker, so they encode like unsigned values
+static inline int Ebml_EncodeID(unsigned char *out, unsigned long class_id)
+{
+    return Ebml_EncodeUnsigned(out, class_id);
+}
+
+//width 1-8, val must fit in 7 * width bits
+static inline int Ebml_EncodeVIntFixed(unsigned char *out, unsigned long long val, int width)
+{
+    val |= 1ULL << (7 * width);
+    Ebml_StoreBE64(out, val << (64 - 8 * width));
+    return width;
+}
+
+static inline int Ebml_EncodeVInt(unsigned char *out, unsigned long long val)
+{
+    return Ebml_EncodeVIntFixed(out, val, Ebml_VIntWidth(val));
+}
+
+
+#endif
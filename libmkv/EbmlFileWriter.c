@@ -0,0 +1,141 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#include "EbmlFileWriter.h"
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int _fileWriteAt(void *refCon, unsigned long long pos, const void *buffer_in, unsigned long len)
+{
+    EbmlFileSink *file = (EbmlFileSink *)refCon;
+    const unsigned char *p = (const unsigned char *)buffer_in;
+    unsigned long long end = pos + len;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(file->fd, p, len, (off_t)pos);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return errno;
+        }
+
+        p += n;
+        pos += n;
+        len -= n;
+    }
+
+    if (end > file->size)
+    {
+        //keep the descriptor offset at the end for the sequential writes
+        file->size = end;
+        lseek(file->fd, (off_t)end, SEEK_SET);
+    }
+
+    return 0;
+}
+
+//plain write so appends also work on pipes and sockets
+static int _fileWrite(void *refCon, const void *buffer_in, unsigned long len)
+{
+    EbmlFileSink *file = (EbmlFileSink *)refCon;
+    const unsigned char *p = (const unsigned char *)buffer_in;
+
+    while (len > 0)
+    {
+        ssize_t n = write(file->fd, p, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return errno;
+        }
+
+        p += n;
+        len -= n;
+        file->size += n;
+    }
+
+    return 0;
+}
+
+static unsigned long long _fileTell(void *refCon)
+{
+    EbmlFileSink *file = (EbmlFileSink *)refCon;
+    return file->size;
+}
+
+static int _fileFlush(void *refCon)
+{
+    //pwrite is unbuffered, durability is left to the caller
+    return 0;
+}
+
+int Ebml_InitFileSink(EbmlSink *sink, EbmlFileSink *file, int fd)
+{
+    off_t end = lseek(fd, 0, SEEK_END);
+
+    //pipes and sockets cannot seek, they only support appends
+    if (end < 0 && errno != ESPIPE)
+        return errno;
+
+    if (end < 0)
+        end = 0;
+
+    file->fd = fd;
+    file->ownsFd = 0;
+    file->size = end;
+
+    sink->write = _fileWrite;
+    sink->writeAt = _fileWriteAt;
+    sink->tell = _fileTell;
+    sink->flush = _fileFlush;
+    sink->attachThread = NULL;
+    sink->detachThread = NULL;
+    sink->refCon = file;
+    return 0;
+}
+
+int Ebml_OpenFileSink(EbmlSink *sink, EbmlFileSink *file, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err;
+
+    if (fd < 0)
+        return errno;
+
+    err = Ebml_InitFileSink(sink, file, fd);
+
+    if (err != 0)
+    {
+        close(fd);
+        return err;
+    }
+
+    file->ownsFd = 1;
+    return 0;
+}
+
+int Ebml_CloseFileSink(EbmlFileSink *file)
+{
+    int err = 0;
+
+    if (file->ownsFd && file->fd >= 0 && close(file->fd) != 0)
+        err = errno;
+
+    file->fd = -1;
+    return err;
+}
@@ -0,0 +1,31 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef EBMLFILEWRITER_HPP
+#define EBMLFILEWRITER_HPP
+
+#include "EbmlSink.h"
+
+//POSIX file descriptor sink, sizes are patched with pwrite.  A pipe or socket
+//works as long as nothing is patched, e.g. for live output.
+typedef struct
+{
+    int fd;
+    int ownsFd;
+    unsigned long long size;
+} EbmlFileSink;
+
+//writes to an already open descriptor starting at its current end
+int Ebml_InitFileSink(EbmlSink *sink, EbmlFileSink *file, int fd);
+//creates or truncates path, the descriptor is closed by Ebml_CloseFileSink
+int Ebml_OpenFileSink(EbmlSink *sink, EbmlFileSink *file, const char *path);
+int Ebml_CloseFileSink(EbmlFileSink *file);
+
+
+#endif
@@ -22,7 +22,7 @@ enum mkv
     DocType = 0x4282,
     DocTypeVersion = 0x4287,
     DocTypeReadVersion = 0x4285,
-//  CRC_32 = 0xBF,
+    CRC_32 = 0xBF,
     Void = 0xEC,
     SignatureSlot = 0x1B538667,
     SignatureAlgo = 0x7E8A,
@@ -0,0 +1,204 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#include "EbmlSegmentWriter.h"
+#include <errno.h>
+
+#define kSegmentPathMax 1024
+
+static void _setError(EbmlSegmentSink *segments, int err)
+{
+    if (err != 0 && segments->err == 0)
+        segments->err = err;
+}
+
+static int _openSegmentFile(EbmlSegmentSink *segments)
+{
+    char path[kSegmentPathMax];
+    int n, err;
+
+    if (segments->segmentNumber == 0)
+        n = snprintf(path, sizeof(path), "%s/init.webm", segments->directory);
+    else
+        n = snprintf(path, sizeof(path), "%s/segment-%05lu.webm", segments->directory,
+                     segments->segmentNumber);
+
+    if (n < 0 || n >= (int)sizeof(path))
+        return ENAMETOOLONG;
+
+    err = Ebml_OpenFileSink(&segments->fileSink, &segments->file, path);
+
+    if (err != 0)
+        return err;
+
+    segments->fileOpen = 1;
+    segments->fileStart = segments->inner->tell(segments->inner->refCon);
+    return 0;
+}
+
+//closes the current file and records it in the index
+static int _closeSegmentFile(EbmlSegmentSink *segments, unsigned long long endMs)
+{
+    int err;
+
+    if (!segments->fileOpen)
+        return 0;
+
+    segments->fileOpen = 0;
+    err = Ebml_CloseFileSink(&segments->file);
+
+    if (segments->segmentNumber == 0)
+        fprintf(segments->index, "init.webm,0,0,%llu\n", segments->file.size);
+    else
+        fprintf(segments->index, "segment-%05lu.webm,%llu,%llu,%llu\n", segments->segmentNumber,
+                segments->startMs, endMs > segments->startMs ? endMs - segments->startMs : 0,
+                segments->file.size);
+
+    if (err == 0 && ferror(segments->index))
+        err = EIO;
+
+    return err;
+}
+
+static int _segmentWrite(void *refCon, const void *buffer_in, unsigned long len)
+{
+    EbmlSegmentSink *segments = (EbmlSegmentSink *)refCon;
+    int err = segments->inner->write(segments->inner->refCon, buffer_in, len);
+
+    if (err == 0 && segments->fileOpen)
+        err = segments->fileSink.write(segments->fileSink.refCon, buffer_in, len);
+
+    _setError(segments, err);
+    return err;
+}
+
+static int _segmentWriteAt(void *refCon, unsigned long long pos, const void *buffer_in, unsigned long len)
+{
+    EbmlSegmentSink *segments = (EbmlSegmentSink *)refCon;
+    const unsigned char *p = (const unsigned char *)buffer_in;
+    int err = segments->inner->writeAt(segments->inner->refCon, pos, buffer_in, len);
+
+    //patches to files already closed are dropped
+    if (err == 0 && segments->fileOpen && pos + len > segments->fileStart)
+    {
+        if (pos < segments->fileStart)
+        {
+            p += segments->fileStart - pos;
+            len -= (unsigned long)(segments->fileStart - pos);
+            pos = segments->fileStart;
+        }
+
+        err = segments->fileSink.writeAt(segments->fileSink.refCon, pos - segments->fileStart, p, len);
+    }
+
+    _setError(segments, err);
+    return err;
+}
+
+static unsigned long long _segmentTell(void *refCon)
+{
+    EbmlSegmentSink *segments = (EbmlSegmentSink *)refCon;
+    return segments->inner->tell(segments->inner->refCon);
+}
+
+static int _segmentFlush(void *refCon)
+{
+    EbmlSegmentSink *segments = (EbmlSegmentSink *)refCon;
+    int err = segments->inner->flush(segments->inner->refCon);
+
+    _setError(segments, err);
+    return err;
+}
+
+static int _segmentAttachThread(void *refCon)
+{
+    EbmlSegmentSink *segments = (EbmlSegmentSink *)refCon;
+    return segments->inner->attachThread(segments->inner->refCon);
+}
+
+static void _segmentDetachThread(void *refCon)
+{
+    EbmlSegmentSink *segments = (EbmlSegmentSink *)refCon;
+    segments->inner->detachThread(segments->inner->refCon);
+}
+
+int Ebml_InitSegmentSink(EbmlSink *sink, EbmlSegmentSink *segments, EbmlSink *inner, const char *directory)
+{
+    char path[kSegmentPathMax];
+    int err;
+
+    segments->inner = inner;
+    segments->directory = directory;
+    segments->fileOpen = 0;
+    segments->segmentNumber = 0;
+    segments->fileStart = 0;
+    segments->startMs = 0;
+    segments->err = 0;
+
+    if (snprintf(path, sizeof(path), "%s/index.csv", directory) >= (int)sizeof(path))
+        return ENAMETOOLONG;
+
+    segments->index = fopen(path, "w");
+
+    if (segments->index == NULL)
+        return errno;
+
+    fprintf(segments->index, "file,start_ms,duration_ms,bytes\n");
+    err = _openSegmentFile(segments);
+
+    if (err != 0)
+    {
+        fclose(segments->index);
+        segments->index = NULL;
+        return err;
+    }
+
+    sink->write = _segmentWrite;
+    sink->writeAt = _segmentWriteAt;
+    sink->tell = _segmentTell;
+    sink->flush = _segmentFlush;
+    sink->attachThread = inner->attachThread ? _segmentAttachThread : NULL;
+    sink->detachThread = inner->detachThread ? _segmentDetachThread : NULL;
+    sink->refCon = segments;
+    return 0;
+}
+
+int Ebml_CutSegment(EbmlSegmentSink *segments, unsigned long long timeMs)
+{
+    if (segments->err != 0)
+        return segments->err;
+
+    _setError(segments, _closeSegmentFile(segments, timeMs));
+
+    if (segments->err == 0)
+    {
+        segments->segmentNumber++;
+        segments->startMs = timeMs;
+        _setError(segments, _openSegmentFile(segments));
+    }
+
+    return segments->err;
+}
+
+int Ebml_EndSegments(EbmlSegmentSink *segments, unsigned long long endTimeMs)
+{
+    _setError(segments, _closeSegmentFile(segments, endTimeMs));
+    return segments->err;
+}
+
+int Ebml_CloseSegmentSink(EbmlSegmentSink *segments, unsigned long long endTimeMs)
+{
+    Ebml_EndSegments(segments, endTimeMs);
+
+    if (segments->index != NULL && fclose(segments->index) != 0)
+        _setError(segments, errno);
+
+    segments->index = NULL;
+    return segments->err;
+}
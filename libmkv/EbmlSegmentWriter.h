@@ -0,0 +1,50 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef EBMLSEGMENTWRITER_HPP
+#define EBMLSEGMENTWRITER_HPP
+
+#include <stdio.h>
+#include "EbmlSink.h"
+#include "EbmlFileWriter.h"
+
+//Sink that passes everything to an inner sink and also copies it, split at
+//the points given by Ebml_CutSegment, into separate files in a directory:
+//  init.webm           everything before the first cut
+//  segment-00001.webm  one file per cut after that
+//  index.csv           file,start_ms,duration_ms,bytes for each file
+//Patches only reach a file while it is still the one being written, so a
+//Segment left with the unknown size keeps it in init.webm and the files can
+//be concatenated or served as DASH initialization and media segments.
+typedef struct
+{
+    EbmlSink *inner;
+    const char *directory;
+    EbmlFileSink file;
+    EbmlSink fileSink;
+    int fileOpen;
+    unsigned long segmentNumber;    //0 for init.webm
+    unsigned long long fileStart;   //output position of the first byte in file
+    unsigned long long startMs;     //time the file starts at
+    FILE *index;
+    int err;
+} EbmlSegmentSink;
+
+//opens directory/init.webm and directory/index.csv, the directory has to exist
+int Ebml_InitSegmentSink(EbmlSink *sink, EbmlSegmentSink *segments, EbmlSink *inner, const char *directory);
+//closes the current file at the end of what the sink has received, so the
+//writer has to be flushed first, and starts the next media segment at timeMs
+int Ebml_CutSegment(EbmlSegmentSink *segments, unsigned long long timeMs);
+//closes the current file, later output only goes to the inner sink
+int Ebml_EndSegments(EbmlSegmentSink *segments, unsigned long long endTimeMs);
+//ends the segments if still open, closes the index and returns the first error
+int Ebml_CloseSegmentSink(EbmlSegmentSink *segments, unsigned long long endTimeMs);
+
+
+#endif
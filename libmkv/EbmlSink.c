@@ -0,0 +1,660 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#include "EbmlSink.h"
+#include "EbmlWriter.h"
+#include "EbmlEncode.h"
+#include "EbmlIDs.h"
+#include "EbmlCRC.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+//largest id plus largest size field
+#define EBML_MAX_HEADER_SIZE 12
+//CRC-32 id, size and 4 byte value
+#define EBML_CRC_ELEMENT_SIZE 6
+
+static int _writeThrough(EbmlGlobal *glob, unsigned long long pos, const void *buffer_in, unsigned long len)
+{
+    EbmlSink *sink = glob->sink;
+    int err;
+
+    //sequential backends only need to support positioned writes for patches
+    if (pos == glob->sinkEnd)
+        err = sink->write(sink->refCon, buffer_in, len);
+    else
+        err = sink->writeAt(sink->refCon, pos, buffer_in, len);
+
+    if (err == 0 && pos + len > glob->sinkEnd)
+        glob->sinkEnd = pos + len;
+
+    if (err != 0 && glob->err == 0)
+        glob->err = err;
+
+    return err;
+}
+
+static int _flushCache(EbmlGlobal *glob)
+{
+    if (glob->cacheLength > 0)
+        _writeThrough(glob, glob->cacheOffset, glob->cache, glob->cacheLength);
+
+    glob->cacheOffset += glob->cacheLength;
+    glob->cacheLength = 0;
+    return glob->err;
+}
+
+//Places len bytes at output position pos.  Appends are collected in the cache,
+//patches to bytes still held in the cache are applied in place and anything
+//else goes straight to the sink as a positioned write.
+static void _writeAt(EbmlGlobal *glob, unsigned long long pos, const void *buffer_in, unsigned long len)
+{
+    unsigned long long cacheEnd = glob->cacheOffset + glob->cacheLength;
+
+    if (glob->cacheLength == 0 && pos != cacheEnd)
+    {
+        //nothing buffered, move the window to the new write position
+        glob->cacheOffset = pos;
+        cacheEnd = pos;
+    }
+
+    if (pos == cacheEnd)
+    {
+        if (glob->cacheLength + len > glob->cacheSize)
+        {
+            _flushCache(glob);
+
+            if (len >= glob->cacheSize)
+            {
+                _writeThrough(glob, pos, buffer_in, len);
+                glob->cacheOffset = pos + len;
+                return;
+            }
+        }
+
+        memcpy(glob->cache + glob->cacheLength, buffer_in, len);
+        glob->cacheLength += len;
+    }
+    else if (pos >= glob->cacheOffset && pos + len <= cacheEnd)
+    {
+        memcpy(glob->cache + (pos - glob->cacheOffset), buffer_in, len);
+    }
+    else
+    {
+        //a partial overlap has to reach the sink before the patch does
+        if (pos < cacheEnd && pos + len > glob->cacheOffset)
+            _flushCache(glob);
+
+        _writeThrough(glob, pos, buffer_in, len);
+    }
+}
+
+int Ebml_InitGlobal(EbmlGlobal *glob, EbmlSink *sink, unsigned long cacheSize)
+{
+    glob->sink = sink;
+    glob->offset = sink->tell(sink->refCon);
+    glob->cache = NULL;
+    glob->cacheSize = 0;
+    glob->cacheLength = 0;
+    glob->cacheOffset = glob->offset;
+    glob->sinkEnd = glob->offset;
+    glob->err = 0;
+    glob->useCRC = 0;
+    glob->scratch = NULL;
+    glob->scratchSize = 0;
+    glob->scratchLength = 0;
+    glob->buildDepth = 0;
+    glob->patches = NULL;
+    glob->patchCount = 0;
+    glob->patchCapacity = 0;
+    glob->patchData = NULL;
+    glob->patchDataLength = 0;
+    glob->patchDataSize = 0;
+    glob->patchReturnOffset = 0;
+
+    if (cacheSize > 0)
+    {
+        glob->cache = malloc(cacheSize);
+
+        if (glob->cache == NULL)
+            return ENOMEM;
+
+        glob->cacheSize = cacheSize;
+    }
+
+    return 0;
+}
+
+int Ebml_Flush(EbmlGlobal *glob)
+{
+    EbmlSink *sink = glob->sink;
+    int err;
+
+    _flushCache(glob);
+    err = sink->flush(sink->refCon);
+
+    if (err != 0 && glob->err == 0)
+        glob->err = err;
+
+    return glob->err;
+}
+
+int Ebml_CloseGlobal(EbmlGlobal *glob)
+{
+    int err;
+
+    Ebml_ApplyPatches(glob);
+    err = Ebml_Flush(glob);
+
+    if (glob->cache != NULL)
+        free(glob->cache);
+
+    glob->cache = NULL;
+    glob->cacheSize = 0;
+
+    if (glob->scratch != NULL)
+        free(glob->scratch);
+
+    glob->scratch = NULL;
+    glob->scratchSize = 0;
+
+    free(glob->patches);
+    free(glob->patchData);
+    glob->patches = NULL;
+    glob->patchCapacity = 0;
+    glob->patchData = NULL;
+    glob->patchDataSize = 0;
+    return err;
+}
+
+//makes room for len more bytes of scratch, returns NULL once out of memory
+static unsigned char *_scratchReserve(EbmlGlobal *glob, unsigned long len)
+{
+    if (glob->scratchLength + len > glob->scratchSize)
+    {
+        unsigned long size = glob->scratchSize ? glob->scratchSize : 4096;
+        unsigned char *scratch;
+
+        while (size < glob->scratchLength + len)
+            size *= 2;
+
+        scratch = realloc(glob->scratch, size);
+
+        if (scratch == NULL)
+        {
+            if (glob->err == 0)
+                glob->err = ENOMEM;
+
+            return NULL;
+        }
+
+        glob->scratch = scratch;
+        glob->scratchSize = size;
+    }
+
+    return glob->scratch + glob->scratchLength;
+}
+
+void Ebml_Write(EbmlGlobal *glob, const void *buffer_in, unsigned long len)
+{
+    if (glob->buildDepth > 0)
+    {
+        unsigned char *dst = _scratchReserve(glob, len);
+
+        if (dst != NULL)
+        {
+            memcpy(dst, buffer_in, len);
+            glob->scratchLength += len;
+        }
+
+        return;
+    }
+
+    _writeAt(glob, glob->offset, buffer_in, len);
+    glob->offset += len;
+}
+
+static void _Serialize(EbmlGlobal *glob, const unsigned char *p, const unsigned char *q)
+{
+    unsigned char reversed[16];
+    unsigned long n = 0;
+
+    //reverse into a local buffer so each call is a single write
+    while (q != p)
+    {
+        --q;
+        reversed[n++] = *q;
+
+        if (n == sizeof(reversed))
+        {
+            Ebml_Write(glob, reversed, n);
+            n = 0;
+        }
+    }
+
+    if (n > 0)
+        Ebml_Write(glob, reversed, n);
+}
+
+void Ebml_Serialize(EbmlGlobal *glob, const void *buffer_in, unsigned long len)
+{
+    //assert(buf);
+
+    const unsigned char *const p = (const unsigned char *)(buffer_in);
+    const unsigned char *const q = p + len;
+
+    _Serialize(glob, p, q);
+}
+
+
+void Ebml_StartSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id)
+{
+    Ebml_WriteID(glob, class_id);
+    ebmlLoc->offset = glob->offset;
+    //todo this is always taking 8 bytes, this may need later optimization
+    unsigned long long unknownLen =  0x01FFFFFFFFFFFFFFLLU;
+    Ebml_Serialize(glob, (void *)&unknownLen, 8); //this is a key that says length unknown
+}
+
+void Ebml_EndSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc)
+{
+    unsigned long long size = glob->offset - ebmlLoc->offset - 8;
+    unsigned long long curOffset = glob->offset;
+
+    //patched in the cache when the size field is still resident
+    glob->offset = ebmlLoc->offset;
+    size |=  0x0100000000000000LLU;
+    Ebml_Serialize(glob, &size, 8);
+    glob->offset = curOffset;
+}
+
+void Ebml_StartElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id)
+{
+    ebmlLoc->offset = glob->offset;
+    ebmlLoc->classId = class_id;
+    ebmlLoc->scratchStart = glob->scratchLength;
+    ebmlLoc->checked = 0;
+
+    //room for the header, filled in once the payload size is known
+    if (_scratchReserve(glob, EBML_MAX_HEADER_SIZE) != NULL)
+        glob->scratchLength += EBML_MAX_HEADER_SIZE;
+
+    glob->buildDepth++;
+}
+
+void Ebml_StartCheckedElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id)
+{
+    static const unsigned char crcElement[EBML_CRC_ELEMENT_SIZE] = {CRC_32, 0x84, 0, 0, 0, 0};
+
+    Ebml_StartElement(glob, ebmlLoc, class_id);
+
+    if (glob->useCRC)
+    {
+        ebmlLoc->checked = 1;
+        Ebml_Write(glob, crcElement, EBML_CRC_ELEMENT_SIZE);
+    }
+}
+
+void Ebml_EndElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc)
+{
+    unsigned char header[EBML_MAX_HEADER_SIZE + 8];
+    unsigned long payloadStart = ebmlLoc->scratchStart + EBML_MAX_HEADER_SIZE;
+    unsigned long payloadLength;
+    int headerLength;
+
+    glob->buildDepth--;
+
+    if (glob->scratchLength < payloadStart)
+    {
+        //ran out of scratch memory, glob->err already says so
+        glob->scratchLength = ebmlLoc->scratchStart;
+        return;
+    }
+
+    payloadLength = glob->scratchLength - payloadStart;
+
+    if (ebmlLoc->checked && payloadLength >= EBML_CRC_ELEMENT_SIZE)
+    {
+        unsigned char *crcValue = glob->scratch + payloadStart + 2;
+        unsigned int crc = Ebml_CRC32(0, glob->scratch + payloadStart + EBML_CRC_ELEMENT_SIZE,
+                                      payloadLength - EBML_CRC_ELEMENT_SIZE);
+
+        //the one little endian value in EBML
+        crcValue[0] = (unsigned char)crc;
+        crcValue[1] = (unsigned char)(crc >> 8);
+        crcValue[2] = (unsigned char)(crc >> 16);
+        crcValue[3] = (unsigned char)(crc >> 24);
+    }
+
+    headerLength = Ebml_EncodeID(header, ebmlLoc->classId);
+    headerLength += Ebml_EncodeVInt(header + headerLength, payloadLength);
+
+    if (glob->buildDepth == 0)
+    {
+        //the outermost payload never moves, the header goes right in front of it
+        unsigned char *element = glob->scratch + payloadStart - headerLength;
+
+        memcpy(element, header, headerLength);
+        glob->scratchLength = 0;
+        Ebml_Write(glob, element, headerLength + payloadLength);
+    }
+    else
+    {
+        unsigned char *element = glob->scratch + ebmlLoc->scratchStart;
+
+        memmove(element + headerLength, glob->scratch + payloadStart, payloadLength);
+        memcpy(element, header, headerLength);
+        glob->scratchLength = ebmlLoc->scratchStart + headerLength + payloadLength;
+    }
+}
+
+int Ebml_IsBuilding(const EbmlGlobal *glob)
+{
+    return glob->buildDepth > 0;
+}
+
+unsigned long Ebml_PendingBytes(const EbmlGlobal *glob)
+{
+    return glob->scratchLength;
+}
+
+static void _writeZeros(EbmlGlobal *glob, unsigned long len)
+{
+    static const unsigned char zeros[4096] = {0};
+
+    while (len > 0)
+    {
+        unsigned long n = len < sizeof(zeros) ? len : sizeof(zeros);
+        Ebml_Write(glob, zeros, n);
+        len -= n;
+    }
+}
+
+//Void header that makes the element exactly size bytes long, returns its length
+static int _encodeVoidHeader(unsigned char *out, unsigned long size)
+{
+    int width;
+
+    for (width = 1; width < 8; width++)
+    {
+        if (size - 1 - width <= (1ULL << (7 * width)) - 2)
+            break;
+    }
+
+    out[0] = Void;
+    return 1 + Ebml_EncodeVIntFixed(out + 1, size - 1 - width, width);
+}
+
+void Ebml_ReserveRegion(EbmlGlobal *glob, EbmlLoc *region, unsigned long size)
+{
+    unsigned char header[16];
+    int headerLength = _encodeVoidHeader(header, size);
+
+    region->offset = glob->offset;
+    region->size = size;
+    Ebml_Write(glob, header, headerLength);
+    _writeZeros(glob, size - headerLength);
+}
+
+void Ebml_StartPatch(EbmlGlobal *glob, EbmlLoc *region)
+{
+    //elements started inside the patch see their final position
+    glob->patchReturnOffset = glob->offset;
+    glob->offset = region->offset;
+    region->scratchStart = glob->scratchLength;
+    glob->buildDepth++;
+}
+
+//grows the size field of the element at the front of the content by a byte
+static int _widenFirstSize(EbmlGlobal *glob, unsigned long start)
+{
+    unsigned char *content = glob->scratch + start;
+    unsigned long length = glob->scratchLength - start;
+    unsigned long long size = 0;
+    int idWidth = 9 - Ebml_BitWidth(content[0]);
+    int sizeWidth, i;
+
+    if (idWidth > 4 || length < (unsigned long)idWidth + 1)
+        return -1;
+
+    sizeWidth = 9 - Ebml_BitWidth(content[idWidth]);
+
+    if (sizeWidth >= 8 || length < (unsigned long)(idWidth + sizeWidth))
+        return -1;
+
+    for (i = 0; i < sizeWidth; i++)
+        size = (size << 8) | content[idWidth + i];
+
+    size &= (1ULL << (7 * sizeWidth)) - 1;
+
+    if (_scratchReserve(glob, 1) == NULL)
+        return -1;
+
+    content = glob->scratch + start;
+    memmove(content + idWidth + sizeWidth + 1, content + idWidth + sizeWidth,
+            length - idWidth - sizeWidth);
+    //fixed width encoding stores 8 bytes, keep them off the payload
+    {
+        unsigned char encoded[8];
+        Ebml_EncodeVIntFixed(encoded, size, sizeWidth + 1);
+        memcpy(content + idWidth, encoded, sizeWidth + 1);
+    }
+    glob->scratchLength++;
+    return 0;
+}
+
+int Ebml_EndPatch(EbmlGlobal *glob, EbmlLoc *region)
+{
+    unsigned long start = region->scratchStart;
+    unsigned long length;
+    int result = 0;
+
+    glob->buildDepth--;
+    glob->offset = glob->patchReturnOffset;
+
+    if (glob->scratchLength < start)
+        glob->scratchLength = start;
+
+    length = glob->scratchLength - start;
+
+    //a Void needs at least two bytes, so absorb a single spare byte
+    if (length + 1 == region->size && _widenFirstSize(glob, start) == 0)
+        length++;
+
+    if (length > region->size || length + 1 == region->size)
+    {
+        //not fatal, the region stays a Void and the caller can write elsewhere
+        result = ENOSPC;
+    }
+    else
+    {
+        if (length < region->size)
+        {
+            unsigned long pad = region->size - length;
+            //the header encoder stores a full 8 bytes past its start
+            unsigned char *dst = _scratchReserve(glob, pad + 8);
+
+            if (dst != NULL)
+            {
+                int headerLength = _encodeVoidHeader(dst, pad);
+                memset(dst + headerLength, 0, pad - headerLength);
+                glob->scratchLength += pad;
+            }
+        }
+
+        if (glob->scratchLength - start == region->size)
+            Ebml_QueuePatch(glob, region->offset, glob->scratch + start, region->size);
+        else
+            result = glob->err;
+    }
+
+    glob->scratchLength = start;
+    return result;
+}
+
+void Ebml_QueuePatch(EbmlGlobal *glob, unsigned long long offset, const void *data, unsigned long len)
+{
+    EbmlPatch *patch;
+
+    if (glob->patchCount == glob->patchCapacity)
+    {
+        unsigned long capacity = glob->patchCapacity ? glob->patchCapacity * 2 : 16;
+        EbmlPatch *patches = realloc(glob->patches, capacity * sizeof(EbmlPatch));
+
+        if (patches == NULL)
+        {
+            if (glob->err == 0)
+                glob->err = ENOMEM;
+
+            return;
+        }
+
+        glob->patches = patches;
+        glob->patchCapacity = capacity;
+    }
+
+    if (glob->patchDataLength + len > glob->patchDataSize)
+    {
+        unsigned long size = glob->patchDataSize ? glob->patchDataSize : 1024;
+        unsigned char *patchData;
+
+        while (size < glob->patchDataLength + len)
+            size *= 2;
+
+        patchData = realloc(glob->patchData, size);
+
+        if (patchData == NULL)
+        {
+            if (glob->err == 0)
+                glob->err = ENOMEM;
+
+            return;
+        }
+
+        glob->patchData = patchData;
+        glob->patchDataSize = size;
+    }
+
+    patch = &glob->patches[glob->patchCount];
+    patch->offset = offset;
+    patch->dataStart = glob->patchDataLength;
+    patch->length = len;
+    patch->sequence = glob->patchCount;
+    memcpy(glob->patchData + glob->patchDataLength, data, len);
+    glob->patchDataLength += len;
+    glob->patchCount++;
+}
+
+void Ebml_DeferEndSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc)
+{
+    unsigned char buf[8];
+    unsigned long long size = glob->offset - ebmlLoc->offset - 8;
+
+    Ebml_EncodeVIntFixed(buf, size, 8);
+    Ebml_QueuePatch(glob, ebmlLoc->offset, buf, 8);
+}
+
+static int _comparePatchOffset(const void *a, const void *b)
+{
+    const EbmlPatch *pa = (const EbmlPatch *)a;
+    const EbmlPatch *pb = (const EbmlPatch *)b;
+
+    if (pa->offset != pb->offset)
+        return pa->offset < pb->offset ? -1 : 1;
+
+    return pa->sequence < pb->sequence ? -1 : (pa->sequence > pb->sequence);
+}
+
+static int _comparePatchSequence(const void *a, const void *b)
+{
+    const EbmlPatch *pa = (const EbmlPatch *)a;
+    const EbmlPatch *pb = (const EbmlPatch *)b;
+    return pa->sequence < pb->sequence ? -1 : (pa->sequence > pb->sequence);
+}
+
+int Ebml_ApplyPatches(EbmlGlobal *glob)
+{
+    unsigned long first = 0;
+    unsigned char *merged = NULL;
+    unsigned long mergedSize = 0;
+
+    qsort(glob->patches, glob->patchCount, sizeof(EbmlPatch), _comparePatchOffset);
+
+    while (first < glob->patchCount)
+    {
+        //a run is a group of patches that touch or overlap
+        unsigned long long runStart = glob->patches[first].offset;
+        unsigned long long runEnd = runStart + glob->patches[first].length;
+        unsigned long last = first + 1;
+        unsigned long i;
+
+        while (last < glob->patchCount && glob->patches[last].offset <= runEnd)
+        {
+            unsigned long long end = glob->patches[last].offset + glob->patches[last].length;
+
+            if (end > runEnd)
+                runEnd = end;
+
+            last++;
+        }
+
+        if (last == first + 1)
+        {
+            EbmlPatch *patch = &glob->patches[first];
+            _writeAt(glob, patch->offset, glob->patchData + patch->dataStart, patch->length);
+        }
+        else
+        {
+            if (runEnd - runStart > mergedSize)
+            {
+                unsigned char *tmp = realloc(merged, runEnd - runStart);
+
+                if (tmp == NULL)
+                {
+                    if (glob->err == 0)
+                        glob->err = ENOMEM;
+
+                    break;
+                }
+
+                merged = tmp;
+                mergedSize = runEnd - runStart;
+            }
+
+            //overlapping bytes take the most recently queued value
+            qsort(glob->patches + first, last - first, sizeof(EbmlPatch), _comparePatchSequence);
+
+            for (i = first; i < last; i++)
+            {
+                EbmlPatch *patch = &glob->patches[i];
+                memcpy(merged + (patch->offset - runStart), glob->patchData + patch->dataStart, patch->length);
+            }
+
+            _writeAt(glob, runStart, merged, runEnd - runStart);
+        }
+
+        first = last;
+    }
+
+    free(merged);
+    glob->patchCount = 0;
+    glob->patchDataLength = 0;
+    return glob->err;
+}
+
+void Ebml_GetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc)
+{
+    ebmlLoc->offset = glob->offset;
+}
+
+void Ebml_SetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc)
+{
+    glob->offset = ebmlLoc->offset;
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+#ifndef EBMLSINK_HPP
+#define EBMLSINK_HPP
+
+//default size of the write combining cache placed in front of a sink
+#define EBML_WRITE_CACHE_SIZE (256 * 1024)
+
+//Destination for the bytes produced by the ebml writer.  Every callback
+//returns 0 on success or a backend specific error code.
+//  write   - append len bytes at the current end of the output
+//  writeAt - place len bytes at an absolute position, used to patch sizes
+//  tell    - current end of the output
+//  flush   - hand anything the backend buffers to the underlying storage
+//Backends that are tied to a thread set attachThread/detachThread, which a
+//background writer calls on its own thread before and after using the sink.
+typedef struct
+{
+    int (*write)(void *refCon, const void *buf, unsigned long len);
+    int (*writeAt)(void *refCon, unsigned long long pos, const void *buf, unsigned long len);
+    unsigned long long (*tell)(void *refCon);
+    int (*flush)(void *refCon);
+    int (*attachThread)(void *refCon);   //optional
+    void (*detachThread)(void *refCon);  //optional
+    void *refCon;
+} EbmlSink;
+
+typedef struct
+{
+    unsigned long long offset;  //size field of a sub element, id of an outermost builder element
+    unsigned long scratchStart; //builder elements only
+    unsigned long classId;      //builder elements only
+    unsigned long size;         //reserved regions only
+    int checked;                //builder element carrying a CRC-32 child
+} EbmlLoc;
+
+//deferred positioned write, the bytes live in EbmlGlobal.patchData
+typedef struct
+{
+    unsigned long long offset;
+    unsigned long dataStart;
+    unsigned long length;
+    unsigned long sequence;
+} EbmlPatch;
+
+typedef struct
+{
+    EbmlSink *sink;
+    unsigned long long offset;
+
+    //bytes [cacheOffset, cacheOffset + cacheLength) of the output that have
+    //not been handed to the sink yet
+    unsigned char *cache;
+    unsigned long cacheSize;
+    unsigned long cacheLength;
+    unsigned long long cacheOffset;
+    unsigned long long sinkEnd;  //end of the output as known by the sink
+    int err;                     //first error returned by the sink
+    int useCRC;                  //Ebml_StartCheckedElement adds a CRC-32 child
+
+    //builder elements are assembled here until the outermost one ends
+    unsigned char *scratch;
+    unsigned long scratchSize;
+    unsigned long scratchLength;
+    int buildDepth;
+
+    //fixups applied in one pass by Ebml_ApplyPatches
+    EbmlPatch *patches;
+    unsigned long patchCount;
+    unsigned long patchCapacity;
+    unsigned char *patchData;
+    unsigned long patchDataLength;
+    unsigned long patchDataSize;
+    unsigned long long patchReturnOffset;  //output position while a patch is captured
+} EbmlGlobal;
+
+
+//cacheSize of 0 writes straight through to the sink
+int Ebml_InitGlobal(EbmlGlobal *glob, EbmlSink *sink, unsigned long cacheSize);
+int Ebml_Flush(EbmlGlobal *glob);
+//applies pending patches, flushes and releases the cache, the sink itself is
+//closed by its owner
+int Ebml_CloseGlobal(EbmlGlobal *glob);
+
+//Reserves an 8 byte size that is patched once the element ends.  Only needed
+//for elements too large to hold in memory (the Segment), and cannot be
+//nested inside a builder element.
+void Ebml_StartSubElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id);
+void Ebml_EndSubElement(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
+
+//Builder elements are assembled in memory and written with a minimal size
+//in one forward write when the outermost one ends.  They may be nested.
+void Ebml_StartElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id);
+void Ebml_EndElement(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
+//Ebml_StartElement that, when glob->useCRC is set, begins the payload with a
+//CRC-32 element over the rest of it, computed by Ebml_EndElement
+void Ebml_StartCheckedElement(EbmlGlobal *glob, EbmlLoc *ebmlLoc, unsigned long class_id);
+//nonzero while a builder element is open
+int Ebml_IsBuilding(const EbmlGlobal *glob);
+//bytes of open builder elements held in memory, headers included
+unsigned long Ebml_PendingBytes(const EbmlGlobal *glob);
+
+//Writes a Void element of exactly size bytes (at least 2) to be filled in
+//later.  Everything written between Ebml_StartPatch and Ebml_EndPatch is
+//captured instead of written, padded with a Void to the region size and
+//queued as a patch.  If the content does not fit Ebml_EndPatch drops it,
+//leaves the region as it is and returns ENOSPC.
+void Ebml_ReserveRegion(EbmlGlobal *glob, EbmlLoc *region, unsigned long size);
+void Ebml_StartPatch(EbmlGlobal *glob, EbmlLoc *region);
+int Ebml_EndPatch(EbmlGlobal *glob, EbmlLoc *region);
+
+//Patch log.  Queued bytes are written, sorted and with adjacent patches
+//merged, by Ebml_ApplyPatches; a later patch wins where two overlap.
+void Ebml_QueuePatch(EbmlGlobal *glob, unsigned long long offset, const void *data, unsigned long len);
+//Ebml_EndSubElement with the size written by the next Ebml_ApplyPatches
+void Ebml_DeferEndSubElement(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
+int Ebml_ApplyPatches(EbmlGlobal *glob);
+
+void Ebml_GetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
+void Ebml_SetEbmlLoc(EbmlGlobal *glob,  EbmlLoc *ebmlLoc);
+
+
+#endif
@@ -8,6 +8,7 @@
 
 
 #include "EbmlWriter.h"
+#include "EbmlEncode.h"
 #include <stdlib.h>
 #include <wchar.h>
 #include <string.h>
@@ -15,21 +16,10 @@
 
 void Ebml_WriteLen(EbmlGlobal *glob, long long val)
 {
-    //TODO check and make sure we are not > than 0x0100000000000000LLU
-    unsigned char size = 8; //size in bytes to output
-    unsigned long long minVal = 0x00000000000000ffLLU; //mask to compare for byte size
-
-    for (size = 1; size < 8; size ++)
-    {
-        if (val < minVal)
-            break;
-
-        minVal = (minVal << 7);
-    }
-
-    val |= (0x000000000000080LLU << ((size - 1) * 7));
-
-    Ebml_Serialize(glob, (void *) &val, size);
+    //TODO check and make sure we are not > than EBML_VINT_MAX
+    unsigned char buf[8];
+    int size = Ebml_EncodeVInt(buf, val);
+    Ebml_Write(glob, buf, size);
 }
 
 void Ebml_WriteString(EbmlGlobal *glob, const char *str)
@@ -56,66 +46,46 @@ void Ebml_WriteUTF8(EbmlGlobal *glob, const wchar_t *wstr)
 
 void Ebml_WriteID(EbmlGlobal *glob, unsigned long class_id)
 {
-    if (class_id >= 0x01000000)
-        Ebml_Serialize(glob, (void *)&class_id, 4);
-    else if (class_id >= 0x00010000)
-        Ebml_Serialize(glob, (void *)&class_id, 3);
-    else if (class_id >= 0x00000100)
-        Ebml_Serialize(glob, (void *)&class_id, 2);
-    else
-        Ebml_Serialize(glob, (void *)&class_id, 1);
+    unsigned char buf[8];
+    int size = Ebml_EncodeID(buf, class_id);
+    Ebml_Write(glob, buf, size);
 }
-void Ebml_SerializeUnsigned64(EbmlGlobal *glob, unsigned long class_id, UInt64 ui)
+
+//id, one byte size and the value packed into a single write
+static void _serializeUnsigned(EbmlGlobal *glob, unsigned long class_id, unsigned long long ui, int width)
 {
-    unsigned char sizeSerialized = 8 | 0x80;
-    Ebml_WriteID(glob, class_id);
-    Ebml_Serialize(glob, &sizeSerialized, 1);
-    Ebml_Serialize(glob, &ui, 8);
+    unsigned char buf[24];
+    int n = Ebml_EncodeID(buf, class_id);
+    n += Ebml_EncodeVIntFixed(buf + n, width, 1);
+    Ebml_StoreBE64(buf + n, ui << (64 - 8 * width));
+    Ebml_Write(glob, buf, n + width);
 }
 
-void Ebml_SerializeUnsigned(EbmlGlobal *glob, unsigned long class_id, unsigned long ui)
+void Ebml_SerializeUnsigned64(EbmlGlobal *glob, unsigned long class_id, unsigned long long ui)
 {
-    unsigned char size = 8; //size in bytes to output
-    unsigned char sizeSerialized = 0;
-    Ebml_WriteID(glob, class_id);
-    unsigned long minVal;
-    minVal = 0x7fLU; //mask to compare for byte size
-
-    for (size = 1; size < 4; size ++)
-    {
-        if (ui < minVal)
-        {
-            break;
-        }
-
-        minVal <<= 7;
-    }
+    _serializeUnsigned(glob, class_id, ui, Ebml_UnsignedWidth(ui));
+}
 
-    sizeSerialized = 0x80 | size;
-    Ebml_Serialize(glob, &sizeSerialized, 1);
-    unsigned int _s = size;
-    Ebml_Serialize(glob, &ui, size);
+void Ebml_SerializeUnsigned(EbmlGlobal *glob, unsigned long class_id, unsigned long ui)
+{
+    _serializeUnsigned(glob, class_id, ui, Ebml_UnsignedWidth(ui));
 }
+
 //TODO: perhaps this is a poor name for this id serializer helper function
 void Ebml_SerializeBinary(EbmlGlobal *glob, unsigned long class_id, unsigned long bin)
 {
-    int size;
-    for (size=4; size > 1; size--)
-    {
-        if (bin & 0x000000ff << ((size-1) * 8))
-            break;
-    }
-    Ebml_WriteID(glob, class_id);
-    Ebml_WriteLen(glob, size);
-    Ebml_WriteID(glob, bin);
+    _serializeUnsigned(glob, class_id, bin, Ebml_UnsignedWidth(bin));
 }
 
 void Ebml_SerializeFloat(EbmlGlobal *glob, unsigned long class_id, double d)
 {
-    Ebml_WriteID(glob, class_id);
-    unsigned char len = 0x88;
-    Ebml_Serialize(glob, &len, 1);
-    Ebml_Serialize(glob,  &d, 8);
+    unsigned char buf[24];
+    unsigned long long bits;
+    int n = Ebml_EncodeID(buf, class_id);
+    buf[n++] = 0x88;
+    memcpy(&bits, &d, 8);
+    Ebml_StoreBE64(buf + n, bits);
+    Ebml_Write(glob, buf, n + 8);
 }
 
 void Ebml_WriteSigned16(EbmlGlobal *glob, short val)
@@ -138,22 +108,26 @@ void Ebml_SerializeUTF8(EbmlGlobal *glob, unsigned long class_id, wchar_t *s)
 
 void Ebml_SerializeData(EbmlGlobal *glob, unsigned long class_id, unsigned char *data, unsigned long data_length)
 {
-    unsigned char size = 4;
-    Ebml_WriteID(glob, class_id);
-    Ebml_WriteLen(glob, data_length);
+    unsigned char buf[16];
+    int n = Ebml_EncodeID(buf, class_id);
+    n += Ebml_EncodeVInt(buf + n, data_length);
+    Ebml_Write(glob, buf, n);
     Ebml_Write(glob,  data, data_length);
 }
 
 void Ebml_WriteVoid(EbmlGlobal *glob, unsigned long vSize)
 {
-    Ebml_WriteID(glob, 0xEC);
-    unsigned char tmp = 0;
-    unsigned long i = 0;
-    Ebml_WriteLen(glob, vSize);
+    static const unsigned char zeros[4096] = {0};
+    unsigned char buf[16];
+    int n = Ebml_EncodeID(buf, 0xEC);
+    n += Ebml_EncodeVInt(buf + n, vSize);
+    Ebml_Write(glob, buf, n);
 
-    for (i = 0; i < vSize; i++)
+    while (vSize > 0)
     {
-        Ebml_Write(glob, &tmp, 1);
+        unsigned long len = vSize < sizeof(zeros) ? vSize : sizeof(zeros);
+        Ebml_Write(glob, zeros, len);
+        vSize -= len;
     }
 }
 
@@ -10,23 +10,20 @@
 #ifndef MKV_CONTEXT_HPP
 #define MKV_CONTEXT_HPP 1
 
-void writeSimpleBock(EbmlGlobal *ebml, unsigned char trackNumber, unsigned short timeCode,
-                     int isKeyframe, unsigned char lacingFlag, int  discardable,
-                     unsigned char *data, unsigned long dataLength);
-
-
 // these are helper functions
 void writeHeader(EbmlGlobal *ebml);
 void writeSegmentInformation(EbmlGlobal *ebml, EbmlLoc* startInfo , unsigned long timeCodeScale, double duration);
 //this function is a helper only, it assumes a lot of defaults
+//codecName is the human readable name, NULL leaves it out
 void writeVideoTrack(EbmlGlobal *ebml, unsigned int trackNumber, int flagLacing,
-                     char *codecId, unsigned int pixelWidth, unsigned int pixelHeight,
+                     char *codecId, char *codecName, unsigned int pixelWidth, unsigned int pixelHeight,
                      double frameRate);
 void writeAudioTrack(EbmlGlobal *glob, unsigned int trackNumber, int flagLacing,
-                     char *codecId, double samplingFrequency, unsigned int channels,
+                     char *codecId, char *codecName, double samplingFrequency, unsigned int channels,
                      unsigned char *private, unsigned long privateSize);
 
-void writeSimpleBlock(EbmlGlobal *glob, unsigned char trackNumber, short timeCode,
+//trackNumber is written as a VINT of minimal width
+void writeSimpleBlock(EbmlGlobal *glob, unsigned long trackNumber, short timeCode,
                       int isKeyframe, int invisible, unsigned char lacingFlag, int discardable,
                       unsigned char *data, unsigned long dataLength);
 
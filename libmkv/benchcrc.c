@@ -0,0 +1,198 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+//CRC-32 throughput of the portable and the dispatched implementation, and
+//what checked clusters cost against a mux into memory and into a file.
+//
+//Acceptance criterion: checked clusters add less than 1% to the time of an
+//export that writes kExportRate MB of output per second.  The bare mux timed
+//here is little more than a copy of the frame data, and no CRC is cheap
+//enough to stay under 1% of a copy of the same bytes, so the cost is
+//measured per MB of output and held against the export instead.  The
+//exporter's output rate is bounded by the VP8 encoder, a few MB/s even for
+//high bitrate HD, so kExportRate leaves about an order of magnitude spare.
+//The share of the bare mux is printed as well, for reference.  Without a
+//hardware crc, slice-by-8 at about 2 GB/s costs some 0.5 ms per MB and only
+//meets the target below 20 MB/s.
+
+#include "EbmlIDs.h"
+#include "EbmlWriter.h"
+#include "EbmlCRC.h"
+#include "EbmlBufferWriter.h"
+#include "EbmlFileWriter.h"
+#include "WebMElement.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define kBufferSize   (4 * 1024 * 1024)
+#define kSourceSize   (128 * 1024 * 1024)  //frames come from here, larger than the caches
+#define kClusters     200
+#define kBlocks       60     //two seconds of 30 fps video per cluster
+#define kRuns         5
+#define kTargetPct    1.0    //checked clusters should add less than this to an export
+#define kExportRate   50.0   //MB of output per second, see above
+
+static double _now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void _throughput(const char *name, unsigned int (*crc32)(unsigned int, const void *, unsigned long),
+                        const unsigned char *data, unsigned long len)
+{
+    unsigned long long bytes = 0;
+    unsigned int crc = 0;
+    unsigned long iterations = (256UL * 1024 * 1024) / len;
+    unsigned long i;
+    double t = _now();
+
+    for (i = 0; i < iterations; i++)
+    {
+        crc += crc32(0, data, len);
+        bytes += len;
+    }
+
+    t = _now() - t;
+    printf("%-12s %8lu bytes %9.1f MB/s (%08x)\n", name, len, bytes / t / 1e6, crc);
+}
+
+//One keyframe and smaller inter frames, roughly a 1 Mbit/s VP8 stream.
+//Each frame is read from a new place in source, so like encoder output it
+//is not in the cache when the muxer copies it.
+static double _muxClusters(EbmlSink *sink, const unsigned char *source, int useCRC,
+                           unsigned long long *bytes)
+{
+    EbmlGlobal glob;
+    unsigned long pos = 0;
+    double t;
+    int i, j;
+
+    Ebml_InitGlobal(&glob, sink, EBML_WRITE_CACHE_SIZE);
+    glob.useCRC = useCRC;
+    t = _now();
+
+    for (i = 0; i < kClusters; i++)
+    {
+        EbmlLoc cluster;
+
+        Ebml_StartCheckedElement(&glob, &cluster, Cluster);
+        Ebml_SerializeUnsigned(&glob, Timecode, i * 2000);
+
+        for (j = 0; j < kBlocks; j++)
+        {
+            unsigned long size = j == 0 ? 40000 : 2000 + (j * 7919) % 4000;
+
+            if (pos + size > kSourceSize)
+                pos = 0;
+
+            writeSimpleBlock(&glob, 1, (short)(j * 33), j == 0, 0, 0, 0, (unsigned char *)source + pos, size);
+            pos += size;
+        }
+
+        Ebml_EndElement(&glob, &cluster);
+    }
+
+    Ebml_CloseGlobal(&glob);
+    t = _now() - t;
+    *bytes = glob.offset;
+    return t;
+}
+
+//best of kRuns, interleaved so both see the same machine state
+static void _muxOverhead(const char *name, const unsigned char *source, const char *path)
+{
+    EbmlBufferSink buffer;
+    EbmlFileSink file;
+    EbmlSink sink;
+    unsigned long long bytes = 0;
+    double time[2] = {1e9, 1e9};
+    double extraPerMB, exportPct;
+    int run, useCRC;
+
+    if (path == NULL)
+        Ebml_InitBufferSink(&sink, &buffer, 0);
+
+    for (run = 0; run < kRuns; run++)
+    {
+        for (useCRC = 0; useCRC < 2; useCRC++)
+        {
+            double t;
+
+            if (path == NULL)
+                Ebml_ResetBufferSink(&buffer);
+            else if (Ebml_OpenFileSink(&sink, &file, path) != 0)
+            {
+                fprintf(stderr, "cannot create %s\n", path);
+                return;
+            }
+
+            t = _muxClusters(&sink, source, useCRC, &bytes);
+
+            if (path != NULL)
+                Ebml_CloseFileSink(&file);
+
+            if (t < time[useCRC])
+                time[useCRC] = t;
+        }
+    }
+
+    if (path == NULL)
+        Ebml_FreeBufferSink(&buffer);
+    else
+        unlink(path);
+
+    //seconds the crc adds per MB of output, and its share of each second of
+    //an export producing kExportRate MB in that second
+    extraPerMB = (time[1] - time[0]) / (bytes / 1e6);
+    exportPct = extraPerMB * kExportRate * 100.0;
+
+    printf("mux %-7s %10llu bytes %8.2f ms plain %8.2f ms checked, %+.1f%% of the bare mux\n",
+           name, bytes, time[0] * 1e3, time[1] * 1e3, (time[1] - time[0]) / time[0] * 100.0);
+    printf("    crc %.3f ms per MB, %+.2f%% of an export at %.0f MB/s (target < %.0f%%: %s)\n",
+           extraPerMB * 1e3, exportPct, kExportRate, kTargetPct, exportPct < kTargetPct ? "met" : "not met");
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned long sizes[] = {64, 1024, 64 * 1024, kBufferSize};
+    unsigned char *data = malloc(kSourceSize);
+    unsigned long i;
+
+    if (data == NULL)
+        return 1;
+
+    srand(1);
+
+    for (i = 0; i < kSourceSize; i++)
+        data[i] = (unsigned char)rand();
+
+    if (Ebml_CRC32(0, "123456789", 9) != 0xCBF43926 ||
+        Ebml_CRC32(0, data, kBufferSize) != Ebml_CRC32SliceBy8(0, data, kBufferSize))
+    {
+        fprintf(stderr, "crc32 self test failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        _throughput("slice-by-8", Ebml_CRC32SliceBy8, data, sizes[i]);
+        _throughput(Ebml_CRC32Implementation(), Ebml_CRC32, data, sizes[i]);
+    }
+
+    _muxOverhead("memory", data, NULL);
+    _muxOverhead("file", data, "benchcrc.tmp");
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,239 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+//Compares the EbmlEncode kernels with the compare loop and byte reverse
+//encoders EbmlWriter used before them.
+
+#include "EbmlIDs.h"
+#include "EbmlWriter.h"
+#include "EbmlEncode.h"
+#include "EbmlBufferWriter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define kValues     4096
+#define kIterations 2000
+
+static double _now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int _legacySerialize(unsigned char *out, const void *in, unsigned long len)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    unsigned long i;
+
+    for (i = 0; i < len; i++)
+        out[i] = p[len - 1 - i];
+
+    return len;
+}
+
+static int _legacyWriteLen(unsigned char *out, long long val)
+{
+    unsigned char size = 8;
+    unsigned long long minVal = 0x00000000000000ffLLU;
+
+    for (size = 1; size < 8; size ++)
+    {
+        if (val < minVal)
+            break;
+
+        minVal = (minVal << 7);
+    }
+
+    val |= (0x000000000000080LLU << ((size - 1) * 7));
+    return _legacySerialize(out, &val, size);
+}
+
+static int _legacyWriteID(unsigned char *out, unsigned long class_id)
+{
+    if (class_id >= 0x01000000)
+        return _legacySerialize(out, &class_id, 4);
+    else if (class_id >= 0x00010000)
+        return _legacySerialize(out, &class_id, 3);
+    else if (class_id >= 0x00000100)
+        return _legacySerialize(out, &class_id, 2);
+    else
+        return _legacySerialize(out, &class_id, 1);
+}
+
+static int _legacySerializeUnsigned64(unsigned char *out, unsigned long class_id, unsigned long long ui)
+{
+    unsigned char sizeSerialized = 8 | 0x80;
+    int n = _legacyWriteID(out, class_id);
+    n += _legacySerialize(out + n, &sizeSerialized, 1);
+    return n + _legacySerialize(out + n, &ui, 8);
+}
+
+//the same cue fields through a real EbmlGlobal, one Ebml_Serialize per field
+static void _legacyCue(EbmlGlobal *glob, unsigned long long pos)
+{
+    unsigned long id = CueClusterPosition;
+    unsigned char sizeSerialized = 8 | 0x80;
+    Ebml_Serialize(glob, &id, 1);
+    Ebml_Serialize(glob, &sizeSerialized, 1);
+    Ebml_Serialize(glob, &pos, 8);
+}
+
+static void _report(const char *name, double seconds, unsigned long long bytes)
+{
+    double ops = (double)kValues * kIterations;
+    printf("%-28s %8.2f ns/op %10llu bytes\n", name, seconds * 1e9 / ops, bytes / kIterations);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long values[kValues];
+    unsigned long ids[kValues];
+    unsigned char *out = malloc(kValues * 24);
+    unsigned long long bytes;
+    unsigned long sink = 0;
+    int i, j;
+    double t;
+
+    //cluster offsets and sizes of a long file: mostly 2-5 byte quantities
+    srand(1);
+
+    for (i = 0; i < kValues; i++)
+    {
+        values[i] = ((unsigned long long)rand() << 8 | rand()) >> (rand() % 40);
+        ids[i] = (i & 1) ? CueClusterPosition : Cluster;
+    }
+
+    for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+    {
+        unsigned char *p = out;
+
+        for (i = 0; i < kValues; i++)
+            p += _legacyWriteLen(p, values[i]);
+
+        bytes += p - out;
+        sink += out[j % 16];
+    }
+
+    _report("vint legacy", _now() - t, bytes);
+
+    for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+    {
+        unsigned char *p = out;
+
+        for (i = 0; i < kValues; i++)
+            p += Ebml_EncodeVInt(p, values[i]);
+
+        bytes += p - out;
+        sink += out[j % 16];
+    }
+
+    _report("vint clz", _now() - t, bytes);
+
+    for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+    {
+        unsigned char *p = out;
+
+        for (i = 0; i < kValues; i++)
+            p += _legacyWriteID(p, ids[i]);
+
+        bytes += p - out;
+        sink += out[j % 16];
+    }
+
+    _report("id legacy", _now() - t, bytes);
+
+    for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+    {
+        unsigned char *p = out;
+
+        for (i = 0; i < kValues; i++)
+            p += Ebml_EncodeID(p, ids[i]);
+
+        bytes += p - out;
+        sink += out[j % 16];
+    }
+
+    _report("id clz", _now() - t, bytes);
+
+    for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+    {
+        unsigned char *p = out;
+
+        for (i = 0; i < kValues; i++)
+            p += _legacySerializeUnsigned64(p, CueClusterPosition, values[i]);
+
+        bytes += p - out;
+        sink += out[j % 16];
+    }
+
+    _report("uint64 element legacy", _now() - t, bytes);
+
+    for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+    {
+        unsigned char *p = out;
+
+        for (i = 0; i < kValues; i++)
+        {
+            int width = Ebml_UnsignedWidth(values[i]);
+            p += Ebml_EncodeID(p, CueClusterPosition);
+            p += Ebml_EncodeVIntFixed(p, width, 1);
+            Ebml_StoreBE64(p, values[i] << (64 - 8 * width));
+            p += width;
+        }
+
+        bytes += p - out;
+        sink += out[j % 16];
+    }
+
+    _report("uint element clz", _now() - t, bytes);
+
+    {
+        EbmlBufferSink buffer;
+        EbmlSink bufferSink;
+        EbmlGlobal glob;
+
+        Ebml_InitBufferSink(&bufferSink, &buffer, 0);
+        Ebml_InitGlobal(&glob, &bufferSink, 0);
+
+        for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+        {
+            Ebml_ResetBufferSink(&buffer);
+            glob.offset = 0;
+
+            for (i = 0; i < kValues; i++)
+                _legacyCue(&glob, values[i]);
+
+            bytes += glob.offset;
+        }
+
+        _report("uint64 EbmlGlobal legacy", _now() - t, bytes);
+
+        for (j = 0, bytes = 0, t = _now(); j < kIterations; j++)
+        {
+            Ebml_ResetBufferSink(&buffer);
+            glob.offset = 0;
+
+            for (i = 0; i < kValues; i++)
+                Ebml_SerializeUnsigned64(&glob, CueClusterPosition, values[i]);
+
+            bytes += glob.offset;
+        }
+
+        _report("uint EbmlGlobal clz", _now() - t, bytes);
+
+        Ebml_CloseGlobal(&glob);
+        Ebml_FreeBufferSink(&buffer);
+    }
+
+    free(out);
+    return sink == 0xFFFFFFFF;
+}
@@ -0,0 +1,411 @@
+// Copyright (c) 2010 The WebM project authors. All Rights Reserved.
+//
+// Use of this source code is governed by a BSD-style license
+// that can be found in the LICENSE file in the root of the source
+// tree. An additional intellectual property rights grant can be found
+// in the file PATENTS.  All contributing project authors may
+// be found in the AUTHORS file in the root of the source tree.
+
+
+//Muxer throughput over synthetic VP8 and Vorbis packet streams.  Every
+//benchmark writes into an in-memory sink and prints one JSON object per
+//line, so runs before and after a change can be diffed or fed to a script.
+//
+//  benchlibmkv [seconds of media, default 600]
+
+#include "EbmlIDs.h"
+#include "EbmlWriter.h"
+#include "EbmlBufferWriter.h"
+#include "WebMElement.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define kRuns              5
+#define kVideoFps          30
+#define kKeyFrameInterval  150     //a keyframe every 5 seconds
+#define kAudioRate         44100
+#define kClusterMs         2000
+#define kMaxPacketSize     (256 * 1024)
+
+typedef struct
+{
+    unsigned char track;          //1 video, 2 audio
+    unsigned char isKeyframe;
+    unsigned long timeMs;
+    unsigned long size;
+} Packet;
+
+typedef struct
+{
+    Packet *packets;
+    unsigned long count;
+    unsigned long long bytes;
+    unsigned long videoCount;
+    unsigned long keyframes;
+} PacketStream;
+
+static unsigned int sSeed = 0x2545F491;
+
+//xorshift, the same stream on every platform
+static unsigned int _random()
+{
+    sSeed ^= sSeed << 13;
+    sSeed ^= sSeed >> 17;
+    sSeed ^= sSeed << 5;
+    return sSeed;
+}
+
+//roughly normal around mean, never below min
+static unsigned long _randomSize(unsigned long mean, unsigned long spread, unsigned long min)
+{
+    long v = (long)mean - (long)spread * 2;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        v += _random() % (spread + 1);
+
+    return v < (long)min ? min : (unsigned long)v;
+}
+
+//1 Mbit/s VP8 at 30 fps: large keyframes, a golden frame every second and
+//inter frames around 3.5 KB.  Vorbis at 128 kbit/s: mostly short blocks of
+//a few hundred bytes.  Packets are interleaved by time as the muxer does.
+static int _makeStream(PacketStream *stream, unsigned long seconds)
+{
+    unsigned long videoFrames = seconds * kVideoFps;
+    unsigned long audioPackets = seconds * kAudioRate / 1024;
+    unsigned long v = 0, a = 0;
+
+    stream->packets = malloc((videoFrames + audioPackets) * sizeof(Packet));
+    stream->count = 0;
+    stream->bytes = 0;
+    stream->videoCount = 0;
+    stream->keyframes = 0;
+
+    if (stream->packets == NULL)
+        return 1;
+
+    while (v < videoFrames || a < audioPackets)
+    {
+        unsigned long videoMs = v * 1000 / kVideoFps;
+        unsigned long audioMs = (unsigned long)((unsigned long long)a * 1024 * 1000 / kAudioRate);
+        Packet *p = &stream->packets[stream->count++];
+
+        if (v < videoFrames && (a >= audioPackets || videoMs <= audioMs))
+        {
+            p->track = 1;
+            p->timeMs = videoMs;
+            p->isKeyframe = v % kKeyFrameInterval == 0;
+
+            if (p->isKeyframe)
+                p->size = _randomSize(36000, 8000, 8000);
+            else if (v % kVideoFps == 0)
+                p->size = _randomSize(9000, 2000, 1000);
+            else
+                p->size = _randomSize(3500, 1500, 200);
+
+            stream->videoCount++;
+            stream->keyframes += p->isKeyframe;
+            v++;
+        }
+        else
+        {
+            p->track = 2;
+            p->timeMs = audioMs;
+            p->isKeyframe = 1;
+            p->size = _random() % 8 == 0 ? _randomSize(1400, 200, 600) : _randomSize(380, 80, 60);
+            a++;
+        }
+
+        stream->bytes += p->size;
+    }
+
+    return 0;
+}
+
+static double _now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void _reset(EbmlGlobal *glob, EbmlBufferSink *buffer)
+{
+    Ebml_ResetBufferSink(buffer);
+    glob->offset = 0;
+    glob->sinkEnd = 0;
+    glob->cacheOffset = 0;
+    glob->cacheLength = 0;
+}
+
+static void _report(const char *name, const char *unit, unsigned long items,
+                    unsigned long long bytes, double seconds)
+{
+    printf("{\"bench\": \"%s\", \"unit\": \"%s\", \"items\": %lu, \"bytes\": %llu, "
+           "\"seconds\": %.6f, \"%s_per_s\": %.0f, \"mb_per_s\": %.2f}\n",
+           name, unit, items, bytes, seconds, unit, items / seconds, bytes / seconds / 1e6);
+}
+
+//blocks of one track (0 for both) in builder clusters, as muxStreams lays them out
+static unsigned long _writeClusters(EbmlGlobal *glob, const PacketStream *stream,
+                                    const unsigned char *payload, int track)
+{
+    unsigned long clusterTime = 0, blocks = 0, i;
+    int clusterOpen = 0;
+    EbmlLoc cluster;
+
+    for (i = 0; i < stream->count; i++)
+    {
+        const Packet *p = &stream->packets[i];
+
+        if (track != 0 && p->track != track)
+            continue;
+
+        if (!clusterOpen || (p->track == 1 && p->isKeyframe) || p->timeMs - clusterTime >= kClusterMs)
+        {
+            if (clusterOpen)
+                Ebml_EndElement(glob, &cluster);
+
+            clusterTime = p->timeMs;
+            Ebml_StartElement(glob, &cluster, Cluster);
+            Ebml_SerializeUnsigned(glob, Timecode, clusterTime);
+            clusterOpen = 1;
+        }
+
+        writeSimpleBlock(glob, p->track, (short)(p->timeMs - clusterTime), p->isKeyframe, 0, 0, 0,
+                         (unsigned char *)payload, p->size);
+        blocks++;
+    }
+
+    if (clusterOpen)
+        Ebml_EndElement(glob, &cluster);
+
+    return blocks;
+}
+
+static void _benchBlocks(const char *name, EbmlGlobal *glob, EbmlBufferSink *buffer,
+                         const PacketStream *stream, const unsigned char *payload, int track)
+{
+    double best = 1e9;
+    unsigned long blocks = 0;
+    int run;
+
+    for (run = 0; run < kRuns; run++)
+    {
+        double t;
+
+        _reset(glob, buffer);
+        t = _now();
+        blocks = _writeClusters(glob, stream, payload, track);
+        Ebml_Flush(glob);
+        t = _now() - t;
+
+        if (t < best)
+            best = t;
+    }
+
+    _report(name, "blocks", blocks, glob->offset, best);
+}
+
+//the value mix muxStreams serializes: timecodes, track numbers and offsets
+static void _benchSerializeUnsigned(EbmlGlobal *glob, EbmlBufferSink *buffer, const PacketStream *stream)
+{
+    double best = 1e9;
+    unsigned long count = 0;
+    int run;
+
+    for (run = 0; run < kRuns; run++)
+    {
+        unsigned long long offset = 0;
+        unsigned long i;
+        double t;
+
+        _reset(glob, buffer);
+        t = _now();
+
+        for (i = 0; i < stream->count; i++)
+        {
+            const Packet *p = &stream->packets[i];
+
+            offset += p->size;
+            Ebml_SerializeUnsigned(glob, Timecode, p->timeMs);
+            Ebml_SerializeUnsigned(glob, CueTrack, p->track);
+            Ebml_SerializeUnsigned(glob, CueClusterPosition, (unsigned long)offset);
+        }
+
+        Ebml_Flush(glob);
+        t = _now() - t;
+        count = stream->count * 3;
+
+        if (t < best)
+            best = t;
+    }
+
+    _report("serialize_unsigned", "elements", count, glob->offset, best);
+}
+
+typedef struct
+{
+    unsigned long timeMs;
+    unsigned long long offset;
+    unsigned long blockNumber;
+} Cue;
+
+//one CuePoint per video keyframe, the way _writeCues builds them
+static void _benchCues(EbmlGlobal *glob, EbmlBufferSink *buffer, const PacketStream *stream)
+{
+    Cue *cueList = malloc((stream->keyframes + 1) * sizeof(Cue));
+    unsigned long long offset = 0;
+    unsigned long i, blockNumber = 0, cueCount = 0, cues = 0;
+    double best = 1e9;
+    int run, pass;
+
+    if (cueList == NULL)
+        return;
+
+    for (i = 0; i < stream->count; i++)
+    {
+        const Packet *p = &stream->packets[i];
+
+        blockNumber++;
+
+        if (p->track == 1 && p->isKeyframe)
+        {
+            cueList[cueCount].timeMs = p->timeMs;
+            cueList[cueCount].offset = offset;
+            cueList[cueCount].blockNumber = blockNumber;
+            cueCount++;
+            blockNumber = 1;
+        }
+
+        offset += p->size + 4;
+    }
+
+    for (run = 0; run < kRuns; run++)
+    {
+        double t;
+
+        _reset(glob, buffer);
+        t = _now();
+
+        //keyframes are sparse, repeat so the timing is not all noise
+        for (pass = 0, cues = 0; pass < 256; pass++)
+        {
+            EbmlLoc cuesLoc;
+
+            Ebml_StartElement(glob, &cuesLoc, Cues);
+
+            for (i = 0; i < cueCount; i++)
+            {
+                EbmlLoc cueHead, trackLoc;
+
+                Ebml_StartElement(glob, &cueHead, CuePoint);
+                Ebml_SerializeUnsigned(glob, CueTime, cueList[i].timeMs);
+                Ebml_StartElement(glob, &trackLoc, CueTrackPositions);
+                Ebml_SerializeUnsigned(glob, CueTrack, 1);
+                Ebml_SerializeUnsigned64(glob, CueClusterPosition, cueList[i].offset);
+                Ebml_SerializeUnsigned(glob, CueBlockNumber, cueList[i].blockNumber);
+                Ebml_EndElement(glob, &trackLoc);
+                Ebml_EndElement(glob, &cueHead);
+                cues++;
+            }
+
+            Ebml_EndElement(glob, &cuesLoc);
+        }
+
+        Ebml_Flush(glob);
+        t = _now() - t;
+
+        if (t < best)
+            best = t;
+    }
+
+    _report("cues", "cuepoints", cues, glob->offset, best);
+    free(cueList);
+}
+
+//small nested masters, the shape of Tracks with a Video or Audio child
+static void _benchNesting(EbmlGlobal *glob, EbmlBufferSink *buffer)
+{
+    const unsigned long count = 200000;
+    double best = 1e9;
+    int run;
+
+    for (run = 0; run < kRuns; run++)
+    {
+        unsigned long i;
+        double t;
+
+        _reset(glob, buffer);
+        t = _now();
+
+        for (i = 0; i < count; i++)
+        {
+            EbmlLoc tracks, entry, video;
+
+            Ebml_StartElement(glob, &tracks, Tracks);
+            Ebml_StartElement(glob, &entry, TrackEntry);
+            Ebml_SerializeUnsigned(glob, TrackNumber, 1);
+            Ebml_SerializeUnsigned(glob, TrackType, 1);
+            Ebml_StartElement(glob, &video, Video);
+            Ebml_SerializeUnsigned(glob, PixelWidth, 1280);
+            Ebml_SerializeUnsigned(glob, PixelHeight, 720);
+            Ebml_EndElement(glob, &video);
+            Ebml_EndElement(glob, &entry);
+            Ebml_EndElement(glob, &tracks);
+        }
+
+        Ebml_Flush(glob);
+        t = _now() - t;
+
+        if (t < best)
+            best = t;
+    }
+
+    _report("nesting", "elements", count * 3, glob->offset, best);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long seconds = argc > 1 ? strtoul(argv[1], NULL, 10) : 600;
+    unsigned char *payload = malloc(kMaxPacketSize);
+    EbmlBufferSink buffer;
+    EbmlSink sink;
+    EbmlGlobal glob;
+    PacketStream stream;
+
+    if (seconds == 0 || payload == NULL || _makeStream(&stream, seconds) != 0)
+    {
+        fprintf(stderr, "usage: benchlibmkv [seconds of media]\n");
+        return 1;
+    }
+
+    memset(payload, 0x5A, kMaxPacketSize);
+
+    if (Ebml_InitBufferSink(&sink, &buffer, 0) != 0 ||
+        Ebml_InitGlobal(&glob, &sink, EBML_WRITE_CACHE_SIZE) != 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("{\"stream\": {\"seconds\": %lu, \"packets\": %lu, \"video\": %lu, \"keyframes\": %lu, \"bytes\": %llu}}\n",
+           seconds, stream.count, stream.videoCount, stream.keyframes, stream.bytes);
+
+    _benchBlocks("simpleblock_vp8", &glob, &buffer, &stream, payload, 1);
+    _benchBlocks("simpleblock_vorbis", &glob, &buffer, &stream, payload, 2);
+    _benchBlocks("simpleblock_interleaved", &glob, &buffer, &stream, payload, 0);
+    _benchSerializeUnsigned(&glob, &buffer, &stream);
+    _benchCues(&glob, &buffer, &stream);
+    _benchNesting(&glob, &buffer);
+
+    Ebml_CloseGlobal(&glob);
+    Ebml_FreeBufferSink(&buffer);
+    free(stream.packets);
+    free(payload);
+    return 0;
+}
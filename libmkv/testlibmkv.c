@@ -9,18 +9,190 @@
 
 
 #include "EbmlIDs.h"
+#include "EbmlWriter.h"
 #include "EbmlBufferWriter.h"
+#include "EbmlAsyncSink.h"
 #include "WebMElement.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define kTestChunkSize 16
+
+//Segment size patched across a chunk boundary, a zero filled gap, the
+//maxSize limit and the iovec export of several chunks, checked byte for byte
+static int _testBufferSink(void)
+{
+    static const unsigned char gapData[2] = {0xAA, 0xBB};
+    static const unsigned char tailData[4] = {0xCC, 0xCC, 0xCC, 0xCC};
+    unsigned char expected[52];
+    unsigned char flat[sizeof(expected)];
+    unsigned char filler[20];
+    struct iovec iov[8];
+    EbmlBufferSink buffer;
+    EbmlSink sink;
+    EbmlGlobal ebml;
+    EbmlLoc segment;
+    unsigned long flatLength = 0;
+    int i, iovCount, result = 0;
+
+    //0-9 filler, 10-13 Segment id, 14-21 size straddling chunks 0 and 1,
+    //22-41 payload, 42-46 gap, 47-48 written past the end, 49-51 up to maxSize
+    for (i = 0; i < 10; i++)
+        expected[i] = (unsigned char)i;
+
+    expected[10] = 0x18;
+    expected[11] = 0x53;
+    expected[12] = 0x80;
+    expected[13] = 0x67;
+    expected[14] = 0x01;
+    memset(expected + 15, 0, 6);
+    expected[21] = 20;
+
+    for (i = 0; i < 20; i++)
+        filler[i] = expected[22 + i] = (unsigned char)(0x20 + i);
+
+    memset(expected + 42, 0, 5);
+    memcpy(expected + 47, gapData, 2);
+    memcpy(expected + 49, tailData, 3);
+
+    Ebml_InitBufferSink(&sink, &buffer, kTestChunkSize);
+    Ebml_InitGlobal(&ebml, &sink, 0);
+    Ebml_Write(&ebml, expected, 10);
+    Ebml_StartSubElement(&ebml, &segment, Segment);
+    Ebml_Write(&ebml, filler, 20);
+    Ebml_EndSubElement(&ebml, &segment);
+
+    if (Ebml_CloseGlobal(&ebml) != 0 || buffer.size != 42)
+    {
+        fprintf(stderr, "buffer sink: segment not written\n");
+        result = 1;
+    }
+
+    if (sink.writeAt(sink.refCon, 47, gapData, 2) != 0 || buffer.size != 49)
+    {
+        fprintf(stderr, "buffer sink: write past the end failed\n");
+        result = 1;
+    }
+
+    buffer.maxSize = 52;
+
+    if (sink.write(sink.refCon, tailData, 4) != ENOSPC || buffer.size != 49)
+    {
+        fprintf(stderr, "buffer sink: write over maxSize not refused\n");
+        result = 1;
+    }
+
+    if (sink.write(sink.refCon, tailData, 3) != 0 || buffer.size != 52)
+    {
+        fprintf(stderr, "buffer sink: write up to maxSize failed\n");
+        result = 1;
+    }
+
+    iovCount = Ebml_BufferIOVecCount(&buffer);
+
+    if (iovCount != 4 || Ebml_BufferIOVec(&buffer, iov, 8) != iovCount)
+    {
+        fprintf(stderr, "buffer sink: %d iovecs instead of 4\n", iovCount);
+        result = 1;
+    }
+    else
+    {
+        for (i = 0; i < iovCount && flatLength + iov[i].iov_len <= sizeof(flat); i++)
+        {
+            memcpy(flat + flatLength, iov[i].iov_base, iov[i].iov_len);
+            flatLength += iov[i].iov_len;
+        }
+
+        if (flatLength != sizeof(expected) || memcmp(flat, expected, sizeof(expected)) != 0)
+        {
+            fprintf(stderr, "buffer sink: contents differ from the expected encoding\n");
+            result = 1;
+        }
+    }
+
+    Ebml_FreeBufferSink(&buffer);
+    return result;
+}
+
+static int detachCount;
+
+static int _failAttach(void *refCon)
+{
+    return EPERM;
+}
+
+static void _countDetach(void *refCon)
+{
+    detachCount++;
+}
+
+//an inner sink that cannot attach to the writer thread is never written,
+//flushed or detached, and the caller still gets through with the error
+static int _testAsyncAttachFailure(void)
+{
+    unsigned char data[40];
+    EbmlBufferSink buffer;
+    EbmlAsyncSink async;
+    EbmlSink inner, sink;
+    int err, result = 0;
+
+    memset(data, 0x55, sizeof(data));
+    Ebml_InitBufferSink(&inner, &buffer, kTestChunkSize);
+    inner.attachThread = _failAttach;
+    inner.detachThread = _countDetach;
+    detachCount = 0;
+
+    if (Ebml_InitAsyncSink(&sink, &async, &inner, kTestChunkSize) != 0)
+    {
+        fprintf(stderr, "async sink: init failed\n");
+        Ebml_FreeBufferSink(&buffer);
+        return 1;
+    }
+
+    //several full buffers, a patch behind them and a flush all have to return
+    sink.write(sink.refCon, data, sizeof(data));
+    sink.writeAt(sink.refCon, 2, data, 4);
+    err = sink.flush(sink.refCon);
+
+    if (err != EPERM)
+    {
+        fprintf(stderr, "async sink: flush returned %d instead of the attach error\n", err);
+        result = 1;
+    }
+
+    err = Ebml_CloseAsyncSink(&async);
+
+    if (err != EPERM)
+    {
+        fprintf(stderr, "async sink: close returned %d instead of the attach error\n", err);
+        result = 1;
+    }
+
+    if (buffer.size != 0 || detachCount != 0)
+    {
+        fprintf(stderr, "async sink: inner sink used after a failed attach\n");
+        result = 1;
+    }
+
+    Ebml_FreeBufferSink(&buffer);
+    return result;
+}
+
 int main(int argc, char *argv[])
 {
     //init the datatype we're using for ebml output
-    unsigned char data[8192];
+    //small chunks so element sizes get patched across chunk boundaries
+    EbmlBufferSink buffer;
+    EbmlSink sink;
     EbmlGlobal ebml;
-    ebml.buf = data;
-    ebml.offset = 0;
-    ebml.length = 8192;
+    Ebml_InitBufferSink(&sink, &buffer, 64);
+    Ebml_InitGlobal(&ebml, &sink, 0);
+    ebml.useCRC = 1;
 
     writeHeader(&ebml);
     {
@@ -29,35 +201,56 @@ int main(int argc, char *argv[])
         {
             //segment info
             EbmlLoc startInfo;
-            Ebml_StartSubElement(&ebml, &startInfo, Info);
+            Ebml_StartCheckedElement(&ebml, &startInfo, Info);
             Ebml_SerializeString(&ebml, 0x4D80, "muxingAppLibMkv");
             Ebml_SerializeString(&ebml, 0x5741, "writingAppLibMkv");
-            Ebml_EndSubElement(&ebml, &startInfo);
+            Ebml_EndElement(&ebml, &startInfo);
         }
 
         {
             EbmlLoc trackStart;
-            Ebml_StartSubElement(&ebml, &trackStart, Tracks);
-            writeVideoTrack(&ebml, 1, 1, "V_MS/VFW/FOURCC", 320, 240, 29.97);
-            //writeAudioTrack(&ebml,2,1, "A_VORBIS", 32000, 1, NULL, 0);
-            Ebml_EndSubElement(&ebml, &trackStart);
+            Ebml_StartCheckedElement(&ebml, &trackStart, Tracks);
+            writeVideoTrack(&ebml, 1, 1, "V_MS/VFW/FOURCC", "VP8", 320, 240, 29.97);
+            //writeAudioTrack(&ebml,2,1, "A_VORBIS", "Vorbis", 32000, 1, NULL, 0);
+            Ebml_EndElement(&ebml, &trackStart);
         }
 
         {
             EbmlLoc clusterStart;
-            Ebml_StartSubElement(&ebml, &clusterStart, Cluster); //cluster
+            Ebml_StartCheckedElement(&ebml, &clusterStart, Cluster); //cluster
             Ebml_SerializeUnsigned(&ebml, Timecode, 0);
 
             unsigned char someData[4] = {1, 2, 3, 4};
             writeSimpleBlock(&ebml, 1, 0,0, 1, 0, 0, someData, 4);
-            Ebml_EndSubElement(&ebml, &clusterStart);
+            Ebml_EndElement(&ebml, &clusterStart);
         }    //end cluster
         Ebml_EndSubElement(&ebml, &startSegment);
     }
 
+    if (Ebml_CloseGlobal(&ebml) != 0)
+    {
+        fprintf(stderr, "failed to build the ebml output\n");
+        return 1;
+    }
+
     //dump ebml stuff to the file
-    FILE *file_out = fopen("test.mkv", "wb");
-    size_t bytesWritten = fwrite(data, 1, ebml.offset, file_out);
-    fclose(file_out);
-    return 0;
-}
\ No newline at end of file
+    int iovCount = Ebml_BufferIOVecCount(&buffer);
+    struct iovec *iov = malloc(iovCount * sizeof(struct iovec));
+    Ebml_BufferIOVec(&buffer, iov, iovCount);
+
+    int fd = open("test.mkv", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ssize_t bytesWritten = writev(fd, iov, iovCount);
+    close(fd);
+
+    int result = bytesWritten == (ssize_t)buffer.size ? 0 : 1;
+    free(iov);
+    Ebml_FreeBufferSink(&buffer);
+
+    if (_testBufferSink() != 0)
+        result = 1;
+
+    if (_testAsyncAttachFailure() != 0)
+        result = 1;
+
+    return result;
+}
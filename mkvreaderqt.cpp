@@ -15,6 +15,7 @@
 #include "mkvreaderqt.hpp"
 
 #include "log.h"
+#include "MemoryAccounting.h"
 
 
 static void ReadCompletion(Ptr request, long refcon, OSErr readErr);
@@ -154,11 +155,13 @@ MkvBufferedReaderQT::MkvBufferedReaderQT()
     : bufDataSize(0), bufStartFilePos(0), bufCurFilePos(0), bufEndFilePos(0),
       m_PendingReadSize(0), chunk_size_(kReadChunkSize), eos_(false) {
   bufDataMax = sizeof(buf);
+  memAccountAdd(kMemReadBuffers, sizeof(buf));
 }
 
 
 //-----------------------------------------------------------------------------
 MkvBufferedReaderQT::~MkvBufferedReaderQT() {
+  memAccountAdd(kMemReadBuffers, -static_cast<SInt64>(sizeof(buf)));
 }
 
 